@@ -11,6 +11,19 @@
 #include "stm8s.h"
 #include "common.h"
 
+// a * b / 65536 without 32 bit overflow of the product, two multiplications instead of a slow division
+uint32_t mul_u32_q16(uint32_t ui32_a, uint16_t ui16_b_x65536) {
+    return ((ui32_a >> 16) * ui16_b_x65536) + (((uint32_t) (uint16_t) ui32_a * ui16_b_x65536) >> 16);
+}
+
+uint8_t ui8_sat_u16(uint16_t ui16_value) {
+    return (ui16_value > 255) ? 255 : (uint8_t) ui16_value;
+}
+
+uint16_t ui16_sat_u32(uint32_t ui32_value) {
+    return (ui32_value > 65535) ? 65535 : (uint16_t) ui32_value;
+}
+
 int16_t map_ui16(int16_t x, int16_t in_min, int16_t in_max, int16_t out_min, int16_t out_max) {
     // if input min is smaller than output min, return the output min value
     if (x < in_min) {
@@ -82,6 +95,47 @@ uint16_t filter(uint16_t ui16_new_value, uint16_t ui16_old_value, uint8_t ui8_al
     }
 }
 
+uint16_t curve_evaluate(struct_curve *p_curve, uint16_t ui16_x) {
+    uint8_t ui8_i;
+    uint8_t ui8_nr_points = p_curve->ui8_nr_points;
+    uint16_t ui16_y0;
+    uint16_t ui16_y1;
+    uint32_t ui32_delta;
+
+    if (ui8_nr_points > CURVE_NR_POINTS_MAX) {
+        ui8_nr_points = CURVE_NR_POINTS_MAX;
+    } else if (!ui8_nr_points) {
+        return 0;
+    }
+
+    // under the first point
+    if (ui16_x <= p_curve->ui16_x[0]) {
+        return p_curve->ui16_y[0];
+    }
+
+    // find the segment, at most CURVE_NR_POINTS_MAX - 1 compares so the time is bounded
+    for (ui8_i = 1; ui8_i < ui8_nr_points; ui8_i++) {
+        if (ui16_x < p_curve->ui16_x[ui8_i]) {
+            // x is over the previous point so the segment width is never 0, even with points not rising
+            ui16_y0 = p_curve->ui16_y[ui8_i - 1];
+            ui16_y1 = p_curve->ui16_y[ui8_i];
+
+            if (ui16_y1 >= ui16_y0) {
+                ui32_delta = ((uint32_t) (ui16_y1 - ui16_y0) * (uint16_t) (ui16_x - p_curve->ui16_x[ui8_i - 1])) /
+                        (uint16_t) (p_curve->ui16_x[ui8_i] - p_curve->ui16_x[ui8_i - 1]);
+                return ui16_y0 + (uint16_t) ui32_delta;
+            } else {
+                ui32_delta = ((uint32_t) (ui16_y0 - ui16_y1) * (uint16_t) (ui16_x - p_curve->ui16_x[ui8_i - 1])) /
+                        (uint16_t) (p_curve->ui16_x[ui8_i] - p_curve->ui16_x[ui8_i - 1]);
+                return ui16_y0 - (uint16_t) ui32_delta;
+            }
+        }
+    }
+
+    // over the last point
+    return p_curve->ui16_y[ui8_nr_points - 1];
+}
+
 // from here: https://github.com/FxDev/PetitModbus/blob/master/PetitModbus.c
 /*
  * Function Name        : CRC16
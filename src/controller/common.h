@@ -16,6 +16,7 @@
 #define WALK_ASSIST_MODE                          3
 #define CRUISE_MODE                               4
 #define MOTOR_CALIBRATION_MODE                    5
+#define MOTOR_TORQUE_ASSIST_MODE                  6
 
 // error codes
 #define NO_ERROR                                  0
@@ -30,6 +31,7 @@
 // uart packet types
 #define UART_PACKET_REGULAR          			  1
 #define UART_PACKET_CONFIG						  2    
+#define UART_PACKET_STATISTICS					  3
 
 
 // walk assist
@@ -43,11 +45,27 @@
 #define TEMPERATURE_CONTROL                       1
 #define THROTTLE_CONTROL                          2
 
+// piecewise linear curve
+#define CURVE_NR_POINTS_MAX                       8
+
+typedef struct _curve
+{
+  uint8_t  ui8_nr_points;                   // curve not in use with less than 2 points
+  uint16_t ui16_x[CURVE_NR_POINTS_MAX];     // input, rising
+  uint16_t ui16_y[CURVE_NR_POINTS_MAX];     // output
+} struct_curve;
+
+// fixed point math
+uint32_t mul_u32_q16(uint32_t ui32_a, uint16_t ui16_b_x65536);
+uint8_t ui8_sat_u16(uint16_t ui16_value);
+uint16_t ui16_sat_u32(uint32_t ui32_value);
+
 int16_t map_ui16(int16_t x, int16_t in_min, int16_t in_max, int16_t out_min, int16_t out_max);
 uint8_t map_ui8(uint8_t x, uint8_t in_min, uint8_t in_max, uint8_t out_max, uint8_t out_min);
 uint8_t ui8_max(uint8_t value_a, uint8_t value_b);
 uint8_t ui8_min(uint8_t value_a, uint8_t value_b);
 uint16_t filter(uint16_t ui16_new_value, uint16_t ui16_old_value, uint8_t ui8_alpha);
+uint16_t curve_evaluate(struct_curve *p_curve, uint16_t ui16_x);
 void crc16(uint8_t ui8_data, uint16_t *ui16_crc);
 
 #endif /* COMMON_COMMON_H_ */
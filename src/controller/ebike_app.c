@@ -22,6 +22,9 @@
 #include "brake.h"
 #include "lights.h"
 #include "common.h"
+#include "eeprom.h"
+#include "timers.h"
+#include "wheel_speed_sensor.h"
 
 // Initial configuration values
 volatile struct_configuration_variables m_configuration_variables = {
@@ -45,6 +48,7 @@ static uint8_t    ui8_riding_mode_parameter_torque = 0;
 static uint8_t    ui8_riding_mode_parameter_torque_soft_start = 0;
 static uint8_t    ui8_power_assist_multiplier_x10 = 0;
 static uint8_t    ui8_torque_assist_factor = 0;
+static uint16_t   ui16_motor_phase_current_per_torque_x100_q16 = (uint16_t)(65536UL / MOTOR_TORQUE_X100_PER_PHASE_ADC_STEP_48V_MOTOR);
 static uint8_t    ui8_system_state = NO_ERROR;
 static uint8_t    ui8_motor_enabled = 1;
 static uint8_t    ui8_lights_configuration = 10;
@@ -58,6 +62,7 @@ static uint16_t   ui8_duty_cycle_ramp_up_inverse_step = PWM_DUTY_CYCLE_RAMP_UP_I
 static uint16_t   ui8_duty_cycle_ramp_up_inverse_step_default = PWM_DUTY_CYCLE_RAMP_UP_INVERSE_STEP_DEFAULT;
 static uint16_t   ui8_duty_cycle_ramp_down_inverse_step = PWM_DUTY_CYCLE_RAMP_DOWN_INVERSE_STEP_DEFAULT;
 static uint16_t   ui16_battery_voltage_filtered_x1000 = 0;
+static uint16_t   ui16_adc_battery_current_per_power_x100_q22 = 0; // battery voltage reciprocal, see main.h
 static uint8_t    ui8_battery_current_filtered_x10 = 0;
 static uint8_t    ui8_adc_battery_current_max = ADC_10_BIT_BATTERY_CURRENT_MAX;
 static uint8_t    ui8_adc_battery_current_target = 0;
@@ -65,24 +70,84 @@ static uint8_t    ui8_duty_cycle_target = 0;
 static uint8_t	  ui8_field_weakening_current_adc = 0;
 static uint8_t	  ui8_adc_battery_current_min = 0;
 
+// motor acceleration, duty cycle ramp inverse steps by wheel speed bin and cadence bin
+#define RAMP_TABLE_BINS                     8
+static uint8_t    ui8_ramp_up_table[RAMP_TABLE_BINS][RAMP_TABLE_BINS];
+static uint8_t    ui8_ramp_down_table[RAMP_TABLE_BINS][RAMP_TABLE_BINS];
+static uint8_t    ui8_ramp_up_throttle_table[RAMP_TABLE_BINS];  // wheel speed bins only
+static uint16_t   ui16_ramp_speed_min_x10 = 40;                 // 4 km/h, first bin
+static uint16_t   ui16_ramp_speed_max_x10 = 200;                // 20 km/h, last bin
+static uint8_t    ui8_ramp_cadence_min = 20;                    // 20 RPM, first bin
+static uint8_t    ui8_ramp_cadence_max = 90;                    // 90 RPM, last bin
+static uint16_t   ui16_ramp_speed_bins_q16 = 0;                 // bins per km/h x10, x65536
+static uint16_t   ui16_ramp_cadence_bins_q16 = 0;               // bins per RPM, x65536
+
 
 // cadence sensor
-uint16_t ui16_cadence_ticks_count_min_speed_adj = CADENCE_SENSOR_CALC_COUNTER_MIN;
 static uint8_t ui8_pedal_cadence_RPM = 0;
+static uint16_t ui16_pedal_cadence_RPM_x10 = 0;
+static uint16_t ui16_cadence_sensor_edge_time_old = 0;
+static uint8_t ui8_cadence_sensor_edge_cycles = 0;
 
 
 // torque sensor
 uint16_t ui16_adc_pedal_torque_offset = 100;
 volatile uint16_t ui16_adc_pedal_torque = 0;
 static uint16_t   ui16_adc_pedal_torque_delta = 0;
+static uint16_t   ui16_adc_pedal_torque_x4 = 0;             // 12 bit equivalent, oversampled
+static uint16_t   ui16_adc_pedal_torque_offset_x4 = 400;
+static uint32_t   ui32_adc_torque_accumulated_old = 0;
+static uint16_t   ui16_adc_torque_accumulated_count_old = 0;
+
+// crank angle resolved torque
+#define CRANK_SECTORS                             20        // one sector for each PAS magnet
+#define CRANK_SECTORS_HALF                        (CRANK_SECTORS / 2)
+static uint16_t   ui16_adc_torque_crank_sector_x4[CRANK_SECTORS];
+static uint8_t    ui8_crank_sector_index = 0;
+static uint8_t    ui8_crank_sector_counter_old = 0;
+static uint32_t   ui32_adc_torque_crank_sector_accumulated_old = 0;
+static uint16_t   ui16_adc_torque_crank_sector_count_old = 0;
+static uint16_t   ui16_adc_pedal_torque_revolution_x4 = 0;  // average of last crank revolution
+static uint16_t   ui16_human_power = 0;                     // W
+static uint8_t    ui8_leg_balance = 50;                     // % of the torque from the first half of the revolution
+static uint8_t    ui8_torque_averaging_enabled = 0;
 static uint16_t   ui16_pedal_torque_x100 = 0;
+static uint8_t    ui8_coaster_brake_torque_threshold = 0;   // ADC steps under the offset, 0 = disabled
 volatile uint16_t  ui16_m_torque_sensor_weight_x10 = 0;
 
 // wheel speed sensor
-static uint16_t ui16_wheel_speed_x10 = 0;
+static uint16_t ui16_wheel_speed_x10 = 0;                   // fused speed from wheel speed sensor and motor speed
+static uint16_t ui16_wheel_speed_sensor_x10 = 0;            // speed from wheel speed sensor only
+static uint8_t  ui8_wheel_speed_sensor_edge_new = 0;
+static uint32_t ui32_wheel_speed_sensor_x10_times_ticks = (uint32_t) 2050 * WHEEL_SPEED_SENSOR_SPEED_X10_TIMES_TICKS; // wheel perimeter / magnets
+static uint16_t ui16_wheel_speed_motor_ratio_x256 = SPEED_FUSION_RATIO_DEFAULT_X256; // learned km/h x10 per motor ERPS
+static uint8_t  ui8_wheel_speed_motor_ratio_learned = 0;
+static uint8_t  ui8_wheel_speed_sensor_fault = 0;
+static uint16_t ui16_wheel_speed_sensor_fault_counter = 0;
+
+// gear shift detection
+static uint8_t  ui8_gear_shift_detection_enabled = 1;
+static uint8_t  ui8_gear_shift_current_x256 = GEAR_SHIFT_CURRENT_X256_DEFAULT;
+static uint8_t  ui8_gear_shift_hold_cycles = GEAR_SHIFT_HOLD_CYCLES_DEFAULT;
+static uint8_t  ui8_gear_shift_ramp_step_x256 = GEAR_SHIFT_RAMP_STEP_X256_DEFAULT;
+static uint16_t ui16_gear_shift_current_factor_x256 = 256;   // applied to the current target, 256 = no reduction
+static uint8_t  ui8_gear_shift_hold_counter = 0;
+static uint8_t  ui8_gear_shift_counter = 0;                  // detected shifts, for telemetry
 
 // throttle control
 volatile uint8_t ui8_adc_throttle = 0;
+static uint16_t ui16_adc_throttle_min = (uint16_t) ADC_THROTTLE_MIN_VALUE << 2;
+static uint16_t ui16_adc_throttle_max = (uint16_t) ADC_THROTTLE_MAX_VALUE << 2;
+static uint8_t  ui8_throttle_calibrated = 0;
+static uint16_t ui16_adc_throttle_min_candidate = 0;
+static uint16_t ui16_adc_throttle_max_candidate = 0;
+static uint8_t  ui8_throttle_min_learn_counter = 0;
+static uint8_t  ui8_throttle_max_learn_counter = 0;
+static uint16_t ui16_throttle_deadband = 0;                 // 0 to 1024
+static uint8_t  ui8_throttle_expo = 0;                      // %, over 100 uses the received curve
+static uint16_t ui16_throttle_current_rate_x256 = 0;        // ADC steps x256 per cycle, 0 is no limit
+static uint16_t ui16_throttle_current_target_x256 = 0;
+static uint16_t ui16_throttle_curve[THROTTLE_CURVE_NR_POINTS] = { 0, 128, 256, 384, 512, 640, 768, 896, 1024 };
 
 // motor temperature control
 static uint16_t ui16_adc_motor_temperature_filtered = 0;
@@ -90,14 +155,90 @@ static uint16_t ui8_motor_temperature_filtered = 0;
 static uint8_t ui8_motor_temperature_max_value_to_limit = 0;
 static uint8_t ui8_motor_temperature_min_value_to_limit = 0;
 
+// motor winding and controller MOSFETs thermal model
+#define THERMAL_MODEL_UPDATE_CYCLES           40          // 40 * 25ms = 1 second
+#define THERMAL_MODEL_PREDICTION_TIME         30          // derate on the temperature predicted 30 seconds ahead
+#define THERMAL_MODEL_DERATING_RANGE          15          // start derating 15 degrees before max temperature
+#define THERMAL_MODEL_TEMPERATURE_RISE_MAX    230000000   // 230 degrees x1000000
+
+typedef struct _thermal_node
+{
+  uint16_t ui16_thermal_resistance_x1000;   // K/W x1000, node to ambient
+  uint16_t ui16_time_constant;              // seconds
+  uint8_t  ui8_temperature_max;
+  uint8_t  ui8_temperature;
+  uint8_t  ui8_temperature_predicted;
+  uint32_t ui32_temperature_rise_x1000000;
+} struct_thermal_node;
+
+static struct_thermal_node m_thermal_winding = { 500, 300, 120, 25, 25, 0 };
+static struct_thermal_node m_thermal_mosfets = { 3000, 60, 100, 25, 25, 0 };
+static uint8_t ui8_thermal_model_enabled = 1;
+static uint8_t ui8_thermal_ambient_temperature = 25;
+
+// battery internal resistance and open circuit voltage estimation
+#define BATTERY_ESTIMATOR_FILTER_COEFFICIENT      6         // 64 * 25ms = 1.6 seconds window
+#define BATTERY_ESTIMATOR_DEVIATION_MAX           8191      // limit deviations so the products fit 32 bit
+#define BATTERY_ESTIMATOR_CURRENT_VARIANCE_MIN    65536     // 4 ADC steps (0.64 A) current deviation
+#define BATTERY_RESISTANCE_FILTER_COEFFICIENT     3
+#define BATTERY_RESISTANCE_X4096_MIN              75        // 10 mOhm
+#define BATTERY_RESISTANCE_X4096_MAX              8192      // 1.09 ohm
+#define BATTERY_CURRENT_LIMIT_FILTER_COEFFICIENT  2
+
+static uint8_t  ui8_battery_voltage_limiting_enabled = 1;
+static uint8_t  ui8_adc_battery_voltage_margin = 12;        // 12 * 0.087 = 1.0 V over cut off voltage
+static uint16_t ui16_battery_resistance_x4096 = BATTERY_RESISTANCE_DEFAULT_X4096;
+static uint16_t ui16_battery_open_circuit_voltage_x64 = 0;
+static uint8_t  ui8_adc_battery_current_voltage_limit = 255;
+
+// ride statistics
+#define RIDE_STATISTICS_HISTOGRAM_SIZE            64        // 8 x 8 bins
+#define RIDE_STATISTICS_NR_BUCKETS                10        // riding modes 0 to 6, field weakening, current limit, speed limit
+#define RIDE_STATISTICS_RIDING_MODES              7         // OFF_MODE to MOTOR_TORQUE_ASSIST_MODE
+#define RIDE_STATISTICS_FIELD_WEAKENING           7
+#define RIDE_STATISTICS_CURRENT_LIMIT             8
+#define RIDE_STATISTICS_SPEED_LIMIT               9
+#define RIDE_STATISTICS_SECOND_CYCLES             200       // 200 * 5ms = 1 second
+#define RIDE_STATISTICS_ENERGY_UNIT               5172414   // 0.1 Wh = 360 J / (0.087 V * 0.16 A * 0.005 s)
+#define RIDE_STATISTICS_NR_WORDS                  ((2 * RIDE_STATISTICS_HISTOGRAM_SIZE) + (2 * RIDE_STATISTICS_NR_BUCKETS))
+#define RIDE_STATISTICS_WORDS_PER_PAGE            5
+#define RIDE_STATISTICS_NR_PAGES                  ((RIDE_STATISTICS_NR_WORDS + RIDE_STATISTICS_WORDS_PER_PAGE - 1) / RIDE_STATISTICS_WORDS_PER_PAGE)
+
+static uint16_t ui16_histogram_erps_current[RIDE_STATISTICS_HISTOGRAM_SIZE];        // ERPS / 64 x battery current / 16 ADC steps
+static uint16_t ui16_histogram_duty_cycle_foc_angle[RIDE_STATISTICS_HISTOGRAM_SIZE]; // duty cycle / 32 x FOC angle / 8
+static uint16_t ui16_ride_time[RIDE_STATISTICS_NR_BUCKETS];                          // seconds
+static uint16_t ui16_ride_energy_x10[RIDE_STATISTICS_NR_BUCKETS];                    // Wh x10
+static uint8_t  ui8_ride_time_counter[RIDE_STATISTICS_NR_BUCKETS];
+static uint32_t ui32_ride_energy_accumulated[RIDE_STATISTICS_NR_BUCKETS];
+static uint8_t  ui8_ride_statistics_page = 0;
+static uint8_t  ui8_speed_limit_active = 0;
+
+// battery charge and energy consumption
+#define BATTERY_CHARGE_UNIT                       450       // 0.1 mAh = 0.36 C / (0.16 A * 0.005 s)
+#define BATTERY_ENERGY_UNIT                       517241    // 0.01 Wh = 36 J / (0.087 V * 0.16 A * 0.005 s)
+#define BATTERY_CONSUMPTION_SAVE_IDLE_CYCLES      400       // 400 * 25ms = 10 seconds
+
+static uint32_t ui32_battery_charge_consumed_x10 = 0;      // mAh x10
+static uint32_t ui32_battery_energy_consumed_x100 = 0;     // Wh x100
+static uint16_t ui16_battery_charge_accumulated = 0;
+static uint32_t ui32_battery_energy_accumulated = 0;
+static uint8_t  ui8_battery_consumption_saved = 1;
+static uint16_t ui16_battery_consumption_idle_counter = 0;
+
 // hybrid assist
 static uint8_t ui8_hybrid_mode_enabled = 0;
 //torque linearization
 static uint8_t ui8_torque_linearization_enabled = 0;
 
-#define TORQUE_SENSOR_LINEARIZE_NR_POINTS 6
+#define TORQUE_SENSOR_LINEARIZE_NR_POINTS 16
+#define TORQUE_SENSOR_LINEARIZE_NR_POINTS_DEFAULT 6   // points from config messages 0 to 5, more from config message 12
 
 uint16_t ui16_torque_sensor_linear_values[TORQUE_SENSOR_LINEARIZE_NR_POINTS * 2];
+// weight x10 (x10 again, divided at the end) at the start of each segment, precomputed from the points
+static uint16_t ui16_torque_sensor_linear_weight[TORQUE_SENSOR_LINEARIZE_NR_POINTS];
+static uint8_t ui8_torque_sensor_linear_nr_points = TORQUE_SENSOR_LINEARIZE_NR_POINTS_DEFAULT;
+static uint8_t ui8_torque_sensor_linear_update = 1;
+static uint16_t ui16_torque_sensor_linear_offset = 0;
 
 /*uint16_t ui16_torque_sensor_linear_values[TORQUE_SENSOR_LINEARIZE_NR_POINTS * 2] =
 {
@@ -112,28 +253,75 @@ uint16_t ui16_torque_sensor_linear_values[TORQUE_SENSOR_LINEARIZE_NR_POINTS * 2]
 */
 
 // eMTB assist
-#define eMTB_POWER_FUNCTION_ARRAY_SIZE      241
-
-static const uint8_t ui8_eMTB_power_function_160[eMTB_POWER_FUNCTION_ARRAY_SIZE] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 4, 4, 4, 4, 4, 4, 4, 5, 5, 5, 5, 5, 5, 6, 6, 6, 6, 6, 6, 7, 7, 7, 7, 7, 8, 8, 8, 8, 8, 9, 9, 9, 9, 9, 10, 10, 10, 10, 10, 11, 11, 11, 11, 12, 12, 12, 12, 12, 13, 13, 13, 13, 14, 14, 14, 14, 15, 15, 15, 15, 16, 16, 16, 16, 17, 17, 17, 17, 18, 18, 18, 18, 19, 19, 19, 20, 20, 20, 20, 21, 21, 21, 22, 22, 22, 22, 23, 23, 23, 24, 24, 24, 24, 25, 25, 25, 26, 26, 26, 27, 27, 27, 27, 28, 28, 28, 29, 29, 29, 30, 30, 30, 31, 31, 31, 32, 32, 32, 33, 33, 33, 34, 34, 34, 35, 35, 35, 36, 36, 36, 37, 37, 37, 38, 38, 38, 39, 39, 40, 40, 40, 41, 41, 41, 42, 42, 42, 43, 43, 44, 44, 44, 45, 45, 45, 46, 46, 47, 47, 47, 48, 48, 48, 49, 49, 50, 50, 50, 51, 51, 52, 52, 52, 53, 53, 54, 54, 54, 55, 55, 56, 56, 56, 57, 57, 58, 58, 58, 59, 59, 60, 60, 61, 61, 61, 62, 62, 63, 63, 63, 64, 64 };
-static const uint8_t ui8_eMTB_power_function_165[eMTB_POWER_FUNCTION_ARRAY_SIZE] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 4, 4, 4, 4, 4, 4, 5, 5, 5, 5, 5, 6, 6, 6, 6, 6, 7, 7, 7, 7, 7, 8, 8, 8, 8, 9, 9, 9, 9, 10, 10, 10, 10, 11, 11, 11, 11, 12, 12, 12, 12, 13, 13, 13, 14, 14, 14, 14, 15, 15, 15, 16, 16, 16, 16, 17, 17, 17, 18, 18, 18, 19, 19, 19, 20, 20, 20, 21, 21, 21, 22, 22, 22, 23, 23, 23, 24, 24, 24, 25, 25, 25, 26, 26, 27, 27, 27, 28, 28, 28, 29, 29, 30, 30, 30, 31, 31, 32, 32, 32, 33, 33, 34, 34, 34, 35, 35, 36, 36, 36, 37, 37, 38, 38, 39, 39, 39, 40, 40, 41, 41, 42, 42, 42, 43, 43, 44, 44, 45, 45, 46, 46, 47, 47, 47, 48, 48, 49, 49, 50, 50, 51, 51, 52, 52, 53, 53, 54, 54, 55, 55, 56, 56, 57, 57, 58, 58, 59, 59, 60, 60, 61, 61, 62, 62, 63, 63, 64, 64, 65, 65, 66, 66, 67, 67, 68, 68, 69, 69, 70, 71, 71, 72, 72, 73, 73, 74, 74, 75, 75, 76, 77, 77, 78, 78, 79, 79, 80, 81, 81, 82, 82, 83, 83, 84, 85 };
-static const uint8_t ui8_eMTB_power_function_170[eMTB_POWER_FUNCTION_ARRAY_SIZE] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 4, 4, 4, 4, 4, 5, 5, 5, 5, 6, 6, 6, 6, 6, 7, 7, 7, 7, 8, 8, 8, 9, 9, 9, 9, 10, 10, 10, 11, 11, 11, 11, 12, 12, 12, 13, 13, 13, 14, 14, 14, 15, 15, 15, 16, 16, 16, 17, 17, 18, 18, 18, 19, 19, 19, 20, 20, 21, 21, 21, 22, 22, 23, 23, 23, 24, 24, 25, 25, 26, 26, 26, 27, 27, 28, 28, 29, 29, 30, 30, 30, 31, 31, 32, 32, 33, 33, 34, 34, 35, 35, 36, 36, 37, 37, 38, 38, 39, 39, 40, 40, 41, 41, 42, 42, 43, 43, 44, 45, 45, 46, 46, 47, 47, 48, 48, 49, 49, 50, 51, 51, 52, 52, 53, 53, 54, 55, 55, 56, 56, 57, 58, 58, 59, 59, 60, 61, 61, 62, 63, 63, 64, 64, 65, 66, 66, 67, 68, 68, 69, 70, 70, 71, 71, 72, 73, 73, 74, 75, 75, 76, 77, 77, 78, 79, 80, 80, 81, 82, 82, 83, 84, 84, 85, 86, 87, 87, 88, 89, 89, 90, 91, 92, 92, 93, 94, 94, 95, 96, 97, 97, 98, 99, 100, 100, 101, 102, 103, 103, 104, 105, 106, 107, 107, 108, 109, 110, 110, 111 };
-static const uint8_t ui8_eMTB_power_function_175[eMTB_POWER_FUNCTION_ARRAY_SIZE] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 6, 6, 6, 6, 7, 7, 7, 8, 8, 8, 8, 9, 9, 9, 10, 10, 10, 11, 11, 11, 12, 12, 13, 13, 13, 14, 14, 14, 15, 15, 16, 16, 17, 17, 17, 18, 18, 19, 19, 20, 20, 20, 21, 21, 22, 22, 23, 23, 24, 24, 25, 25, 26, 26, 27, 27, 28, 28, 29, 29, 30, 31, 31, 32, 32, 33, 33, 34, 34, 35, 36, 36, 37, 37, 38, 39, 39, 40, 40, 41, 42, 42, 43, 44, 44, 45, 45, 46, 47, 47, 48, 49, 49, 50, 51, 51, 52, 53, 53, 54, 55, 56, 56, 57, 58, 58, 59, 60, 61, 61, 62, 63, 64, 64, 65, 66, 67, 67, 68, 69, 70, 70, 71, 72, 73, 74, 74, 75, 76, 77, 78, 78, 79, 80, 81, 82, 83, 83, 84, 85, 86, 87, 88, 88, 89, 90, 91, 92, 93, 94, 95, 95, 96, 97, 98, 99, 100, 101, 102, 103, 104, 105, 105, 106, 107, 108, 109, 110, 111, 112, 113, 114, 115, 116, 117, 118, 119, 120, 121, 122, 123, 124, 125, 126, 127, 128, 129, 130, 131, 132, 133, 134, 135, 136, 137, 138, 139, 140, 141, 142, 143, 144, 145, 146 };
-static const uint8_t ui8_eMTB_power_function_180[eMTB_POWER_FUNCTION_ARRAY_SIZE] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 6, 6, 6, 7, 7, 7, 8, 8, 8, 9, 9, 9, 10, 10, 11, 11, 11, 12, 12, 13, 13, 14, 14, 14, 15, 15, 16, 16, 17, 17, 18, 18, 19, 19, 20, 20, 21, 21, 22, 23, 23, 24, 24, 25, 25, 26, 27, 27, 28, 28, 29, 30, 30, 31, 32, 32, 33, 34, 34, 35, 36, 36, 37, 38, 38, 39, 40, 41, 41, 42, 43, 43, 44, 45, 46, 46, 47, 48, 49, 50, 50, 51, 52, 53, 54, 54, 55, 56, 57, 58, 59, 59, 60, 61, 62, 63, 64, 65, 66, 67, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76, 77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 88, 89, 90, 91, 92, 93, 94, 95, 96, 97, 98, 99, 100, 101, 102, 103, 105, 106, 107, 108, 109, 110, 111, 112, 114, 115, 116, 117, 118, 119, 120, 122, 123, 124, 125, 126, 128, 129, 130, 131, 132, 134, 135, 136, 137, 139, 140, 141, 142, 144, 145, 146, 147, 149, 150, 151, 153, 154, 155, 157, 158, 159, 161, 162, 163, 165, 166, 167, 169, 170, 171, 173, 174, 176, 177, 178, 180, 181, 182, 184, 185, 187, 188, 190, 191, 192 };
-static const uint8_t ui8_eMTB_power_function_195[eMTB_POWER_FUNCTION_ARRAY_SIZE] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 2, 2, 2, 3, 3, 3, 3, 4, 4, 5, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 13, 13, 14, 15, 15, 16, 17, 17, 18, 19, 20, 21, 21, 22, 23, 24, 25, 26, 27, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 39, 40, 41, 42, 43, 44, 45, 47, 48, 49, 50, 51, 53, 54, 55, 57, 58, 59, 61, 62, 63, 65, 66, 68, 69, 70, 72, 73, 75, 76, 78, 79, 81, 83, 84, 86, 87, 89, 91, 92, 94, 96, 97, 99, 101, 103, 104, 106, 108, 110, 112, 113, 115, 117, 119, 121, 123, 125, 127, 129, 131, 132, 134, 136, 139, 141, 143, 145, 147, 149, 151, 153, 155, 157, 160, 162, 164, 166, 168, 171, 173, 175, 177, 180, 182, 184, 187, 189, 191, 194, 196, 199, 201, 203, 206, 208, 211, 213, 216, 218, 221, 224, 226, 229, 231, 234, 237, 239, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240 };
-static const uint8_t ui8_eMTB_power_function_210[eMTB_POWER_FUNCTION_ARRAY_SIZE] = { 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4, 5, 5, 6, 7, 7, 8, 9, 9, 10, 11, 12, 13, 14, 14, 15, 16, 17, 19, 20, 21, 22, 23, 24, 26, 27, 28, 30, 31, 32, 34, 35, 37, 39, 40, 42, 43, 45, 47, 49, 50, 52, 54, 56, 58, 60, 62, 64, 66, 68, 71, 73, 75, 77, 80, 82, 84, 87, 89, 92, 94, 97, 99, 102, 104, 107, 110, 113, 115, 118, 121, 124, 127, 130, 133, 136, 139, 142, 145, 149, 152, 155, 158, 162, 165, 169, 172, 176, 179, 183, 186, 190, 194, 197, 201, 205, 209, 213, 216, 220, 224, 228, 232, 237, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240 };
-static const uint8_t ui8_eMTB_power_function_225[eMTB_POWER_FUNCTION_ARRAY_SIZE] = { 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 3, 3, 4, 4, 5, 6, 7, 8, 8, 9, 10, 12, 13, 14, 15, 17, 18, 20, 21, 23, 24, 26, 28, 30, 32, 34, 36, 38, 40, 43, 45, 47, 50, 52, 55, 58, 61, 64, 66, 70, 73, 76, 79, 82, 86, 89, 93, 96, 100, 104, 108, 112, 116, 120, 124, 128, 133, 137, 142, 146, 151, 156, 161, 166, 171, 176, 181, 186, 191, 197, 202, 208, 214, 219, 225, 231, 237, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240 };
-static const uint8_t ui8_eMTB_power_function_240[eMTB_POWER_FUNCTION_ARRAY_SIZE] = { 0, 0, 0, 0, 0, 0, 1, 1, 1, 2, 3, 3, 4, 5, 6, 7, 8, 9, 10, 12, 13, 15, 17, 19, 21, 23, 25, 27, 30, 32, 35, 38, 41, 44, 47, 51, 54, 58, 62, 66, 70, 74, 79, 83, 88, 93, 98, 103, 108, 114, 120, 125, 131, 137, 144, 150, 157, 164, 171, 178, 185, 193, 200, 208, 216, 224, 233, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240 };
-static const uint8_t ui8_eMTB_power_function_255[eMTB_POWER_FUNCTION_ARRAY_SIZE] = { 0, 0, 0, 0, 0, 1, 1, 1, 2, 3, 4, 5, 6, 7, 8, 10, 12, 14, 16, 18, 21, 24, 26, 30, 33, 37, 41, 45, 49, 54, 58, 64, 69, 75, 80, 87, 93, 100, 107, 114, 122, 130, 138, 146, 155, 164, 174, 184, 194, 204, 215, 226, 238, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240, 240 };
+#define eMTB_POWER_FUNCTION_X_MAX           240
+#define eMTB_POWER_FUNCTION_Y_MAX           240
+#define eMTB_POWER_FUNCTION_LOG2_100_X4096  27213   // log2(100) x4096
+static uint8_t  ui8_eMTB_exponent_x100 = 0;
+static uint16_t ui16_eMTB_exponent_x4096 = 0;
+static const uint8_t ui8_eMTB_legacy_exponent_x100[10] = { 160, 165, 170, 175, 180, 195, 210, 225, 240, 255 };
+// log2(1 + i/32) x4096
+static const uint16_t ui16_log2_table[33] = { 0, 182, 358, 530, 696, 858, 1016, 1169, 1319, 1465, 1607, 1746, 1882, 2015, 2145, 2272, 2396,
+    2518, 2637, 2754, 2869, 2982, 3092, 3200, 3307, 3412, 3514, 3615, 3715, 3812, 3908, 4003, 4096 };
+// 2^(i/32) x16384
+static const uint16_t ui16_exp2_table[33] = { 16384, 16743, 17109, 17484, 17867, 18258, 18658, 19066, 19484, 19911, 20347, 20792, 21247, 21713, 22188, 22674, 23170,
+    23678, 24196, 24726, 25268, 25821, 26386, 26964, 27554, 28158, 28774, 29405, 30048, 30706, 31379, 32066, 32768 };
+
+// assist curves, uploaded with config message 17 and saved in data EEPROM
+#define ASSIST_CURVE_POWER                  0   // human power W -> assist power W with power assist multiplier x1
+#define ASSIST_CURVE_TORQUE                 1   // pedal torque ADC steps -> torque assist before the torque assist factor
+#define ASSIST_CURVE_eMTB                   2   // pedal torque ADC steps -> battery current ADC steps
+#define ASSIST_CURVE_THROTTLE               3   // throttle 0 to 1024 after deadband -> throttle 0 to 1024
+#define ASSIST_CURVE_NR_POINTS_MIN          2   // less points and the curve is not in use
+#define ASSIST_CURVE_POINT_SET_NR_POINTS    15  // received point index to set the number of points
+static struct_curve m_assist_curves[ASSIST_CURVES_NR];
+static uint8_t ui8_assist_curves_save = 0;      // one bit for each curve to save
+#define ASSIST_CURVE_SAVE_NONE              0xff
+#define ASSIST_CURVE_SAVE_WRITES_PER_CYCLE  2   // each changed byte blocks some milliseconds
+static uint8_t ui8_assist_curve_saving = ASSIST_CURVE_SAVE_NONE;  // curve being saved
+static uint8_t ui8_assist_curve_save_index = 0;                    // next byte of the curve to save
+
+// walk assist
+static uint8_t ui8_walk_assist_initialize = 1;
 
 // cruise
-static int16_t i16_cruise_pid_kp = 0;
-static int16_t i16_cruise_pid_ki = 0;
+static uint16_t ui16_cruise_pid_kp_x256 = CRUISE_PID_KP_X256_48V_MOTOR;
+static uint16_t ui16_cruise_pid_ki_x256 = CRUISE_PID_KI_X256_48V_MOTOR;
 static uint8_t ui8_cruise_PID_initialize = 1;
 static uint16_t ui16_wheel_speed_target_received_x10 = 0;
 
+// launch profile from standstill, soft start levels blended into the normal assist
+#define LAUNCH_SPEED_STANDSTILL_X10             5         // 0.5 km/h, fused speed so the motor speed is seen before the wheel magnet
+#define LAUNCH_CRANK_REVOLUTIONS_DEFAULT        2
+#define LAUNCH_TIME_X10_DEFAULT                 30        // 3 seconds
+#define LAUNCH_HOLD_X256_DEFAULT                64        // soft start levels for the first quarter of the launch
+
+static uint8_t  ui8_launch_active = 0;
+static uint16_t ui16_launch_crank_step_q16 = 0;         // progress x65536 per crank sector, from the crank revolutions
+static uint16_t ui16_launch_time_step_q16 = 0;          // progress x65536 per 25ms cycle, from the launch time
+static uint8_t  ui8_launch_hold_x256 = LAUNCH_HOLD_X256_DEFAULT;
+static uint16_t ui16_launch_fade_x256 = (uint16_t) (65536UL / (256 - LAUNCH_HOLD_X256_DEFAULT));
+
+// road load and slope estimation
+#define ROAD_LOAD_UPDATE_CYCLES                 10        // 10 * 25ms = 250ms, averages divided with DIVIDE_BY_10_Q16
+#define ROAD_LOAD_SPEED_MIN_X10                 60        // 6 km/h, power over speed is not reliable under
+#define ROAD_LOAD_SPEED_DELTA_MAX_X10           50        // 5 km/h in 250ms is a speed glitch
+#define ROAD_LOAD_MOTOR_POWER_X4096             46        // W per voltage ADC step * current ADC step with 80% efficiency: 0.087 * 0.16 * 0.8 * 4096
+#define ROAD_LOAD_ROLLING_FORCE_X10_PER_KG_Q16  51446     // 9.81 * 0.008 rolling coefficient * 10, x65536
+#define ROAD_LOAD_AERO_FORCE_X10_Q16            152       // 0.5 * 1.2 kg/m3 * 0.5 m2 CdA * 10 / 36^2 per (km/h x10)^2, x65536
+#define ROAD_LOAD_GRADE_X10_PER_FORCE_X10       102       // 1000 / 9.81, divided by the mass x10
+#define ROAD_LOAD_GRADE_FILTER_COEFFICIENT      2         // 4 * 250ms = 1 second
+#define ROAD_LOAD_GRADE_X10_MAX                 300       // 30 %
+#define ROAD_LOAD_MASS_KG_MIN                   20
+
+static uint8_t  ui8_road_load_mass_kg = 100;                 // rider, bike and load
+static uint8_t  ui8_road_load_assist_boost = 0;              // assist % more for each 1 % of grade, 0 = disabled
+static uint8_t  ui8_road_load_assist_boost_max = 50;         // %
+static int16_t  i16_road_grade_x10 = 0;                      // % x10, positive uphill
+static uint16_t ui16_road_load_force_x10 = 0;                // N x10, rolling, aerodynamic and grade resistance
+
 // UART
 #define UART_NUMBER_DATA_BYTES_TO_RECEIVE   10   // change this value depending on how many data bytes there are to receive ( Package = one start byte + data bytes + two bytes 16 bit CRC )
-#define UART_NUMBER_DATA_BYTES_TO_SEND      21  // change this value depending on how many data bytes there are to send ( Package = one start byte + data bytes + two bytes 16 bit CRC )
+#define UART_NUMBER_DATA_BYTES_TO_SEND      43  // change this value depending on how many data bytes there are to send ( Package = one start byte + data bytes + two bytes 16 bit CRC )
 
 volatile uint8_t ui8_received_package_flag = 0;
 volatile uint8_t ui8_rx_buffer[UART_NUMBER_DATA_BYTES_TO_RECEIVE + 3];
@@ -161,21 +349,47 @@ static void get_battery_voltage_filtered(void);
 static void get_battery_current_filtered(void);
 static void get_pedal_torque(void);
 static void calc_wheel_speed(void);
+static void calc_speed_fusion(void);
+static void calc_gear_shift(void);
+static void apply_gear_shift_current_reduction(void);
 static void calc_cadence(void);
 
 static void ebike_control_lights(void);
 static void ebike_control_motor(void);
 static void check_system(void);
-
+static void calc_ride_statistics(void);
+static void calc_battery_consumption(void);
+static void calc_crank_sector_torque(void);
+static void calc_human_power(void);
+static void calc_road_load(void);
+static void save_battery_consumption(void);
+static void load_assist_curves(void);
+static void save_assist_curves(void);
+static uint8_t get_assist_curve_eeprom_byte(struct_curve *p_curve, uint8_t ui8_index);
+static void reset_ride_statistics(void);
+static uint16_t get_ride_statistics_word(uint8_t ui8_index);
+
+static void calc_ramp_tables(void);
+static void set_launch_profile(uint8_t ui8_crank_revolutions, uint8_t ui8_time_x10);
+static uint16_t get_launch_profile_x256(void);
+static void set_motor_acceleration(void);
 static void apply_power_assist();
 static void apply_emtb_assist();
+static void apply_motor_torque_assist();
+static uint8_t get_emtb_power_function(uint8_t ui8_x, uint16_t ui16_exponent_x4096);
 static void apply_walk_assist();
 static void apply_cruise();
 static void apply_calibration_assist();
 static void apply_throttle();
 static void apply_temperature_limiting();
+static void apply_thermal_derating();
 static void apply_speed_limit();
+static void calc_thermal_model(void);
+static void calc_battery_resistance(void);
+static void apply_battery_voltage_limiting();
+static void update_thermal_node(struct_thermal_node *p_node, uint32_t ui32_power_losses_mW);
 static void linearize_torque_sensor_to_kgs(uint16_t *ui16_p_torque_sensor_adc_steps, uint16_t *ui16_torque_sensor_weight);
+static void calc_torque_sensor_linear_weight(void);
 
 
 void ebike_app_controller (void)
@@ -183,12 +397,17 @@ void ebike_app_controller (void)
   static uint8_t ui8_counter;  
   
   calc_wheel_speed();               // calculate the wheel speed
+  calc_speed_fusion();              // fuse wheel speed with motor speed and check wheel speed sensor
   calc_cadence();                   // calculate the cadence and set limits from wheel speed
   
   get_battery_voltage_filtered();   // get filtered voltage from FOC calculations
   get_battery_current_filtered();   // get filtered current from FOC calculations
+  calc_battery_resistance();        // estimate battery internal resistance and open circuit voltage
   get_pedal_torque();               // get pedal torque
-  
+  calc_human_power();               // per revolution average torque, human power and leg balance
+  calc_road_load();                 // estimate road load and grade from power, speed and acceleration
+  calc_thermal_model();             // estimate motor winding and MOSFETs temperatures
+
   check_system();                   // check if there are any errors for motor control 
     
   // send/receive data every 4 cycles (30ms * 4)
@@ -197,6 +416,8 @@ void ebike_app_controller (void)
   
   ebike_control_lights();           // use received data and sensor input to control external lights
   ebike_control_motor();            // use received data and sensor input to control motor
+  save_battery_consumption();       // save battery consumption to EEPROM when the motor is stopped
+  save_assist_curves();             // save received assist curves to EEPROM when the motor is stopped
   
   /*------------------------------------------------------------------------
   
@@ -210,6 +431,34 @@ void ebike_app_controller (void)
 
 
 
+void ebike_app_fast_controller (void)
+{
+  calc_ride_statistics();           // accumulate operating point histograms and ride statistics
+  calc_battery_consumption();       // integrate battery charge and energy
+  calc_crank_sector_torque();       // bin torque samples by crank sector
+  calc_gear_shift();                // detect gear shifts and cut the motor current
+}
+
+
+
+void ebike_app_init (void)
+{
+  // battery consumption counters saved at last power down
+  ui32_battery_charge_consumed_x10 = eeprom_read_uint32(ADDRESS_BATTERY_CHARGE_CONSUMED_X10);
+  ui32_battery_energy_consumed_x100 = eeprom_read_uint32(ADDRESS_BATTERY_ENERGY_CONSUMED_X100);
+
+  // assist curves saved from the last upload
+  load_assist_curves();
+  
+  // motor acceleration with the default setting
+  calc_ramp_tables();
+  
+  // launch profile with the default setting
+  set_launch_profile(LAUNCH_CRANK_REVOLUTIONS_DEFAULT, LAUNCH_TIME_X10_DEFAULT);
+}
+
+
+
 static void ebike_control_motor (void)
 {
   // reset control variables (safety)
@@ -221,6 +470,9 @@ static void ebike_control_motor (void)
   // reset initialization of Cruise PID controller
   if (ui8_riding_mode != CRUISE_MODE) { ui8_cruise_PID_initialize = 1; }
   
+  // reset initialization of walk assist speed controller
+  if (ui8_riding_mode != WALK_ASSIST_MODE) { ui8_walk_assist_initialize = 1; }
+  
   // select riding mode
   switch (ui8_riding_mode)
   {
@@ -228,6 +480,8 @@ static void ebike_control_motor (void)
    
     case eMTB_ASSIST_MODE: apply_emtb_assist(); break;
     
+    case MOTOR_TORQUE_ASSIST_MODE: apply_motor_torque_assist(); break;
+    
     case WALK_ASSIST_MODE: apply_walk_assist(); break;
     
     case CRUISE_MODE: apply_cruise(); break;
@@ -243,10 +497,19 @@ static void ebike_control_motor (void)
     
     case TEMPERATURE_CONTROL: apply_temperature_limiting(); break;
   }
-  
+
+  // winding and MOSFETs thermal model derating
+  if (ui8_thermal_model_enabled) { apply_thermal_derating(); }
+
+  // keep loaded battery voltage over the cut off voltage
+  if (ui8_battery_voltage_limiting_enabled) { apply_battery_voltage_limiting(); }
+
   // speed limit
   apply_speed_limit();
   
+  // reduce current during gear shifts
+  apply_gear_shift_current_reduction();
+  
    // reset control parameters if... (safety)
     if (ui8_brake_state || ui8_system_state != NO_ERROR || !ui8_motor_enabled) {
         ui8_controller_duty_cycle_ramp_up_inverse_step = PWM_DUTY_CYCLE_RAMP_UP_INVERSE_STEP_DEFAULT;
@@ -292,6 +555,12 @@ static void ebike_control_motor (void)
         ui8_controller_duty_cycle_target = ui8_duty_cycle_target;
     }
 
+    // PWM outputs disabled by the brake in the PWM interrupt
+    if (ui8_brake_pwm_disabled) {
+        ui8_brake_pwm_disabled = 0;
+        ui8_motor_enabled = 0;
+    }
+
     // check if the motor should be enabled or disabled
     if (ui8_motor_enabled
             && (ui16_motor_speed_erps == 0)
@@ -315,9 +584,89 @@ static void ebike_control_motor (void)
 
 
 
+static void calc_ramp_tables(void)
+{
+  uint8_t ui8_speed_bin;
+  uint8_t ui8_cadence_bin;
+  uint8_t ui8_bin;
+  
+  // bins are evenly spaced from the min value (first bin) to the max value (last bin)
+  ui16_ramp_speed_bins_q16 = (uint16_t) (((uint32_t) (RAMP_TABLE_BINS - 1) << 16) / (ui16_ramp_speed_max_x10 - ui16_ramp_speed_min_x10));
+  ui16_ramp_cadence_bins_q16 = (uint16_t) (((uint32_t) (RAMP_TABLE_BINS - 1) << 16) / (uint8_t) (ui8_ramp_cadence_max - ui8_ramp_cadence_min));
+  
+  for (ui8_speed_bin = 0; ui8_speed_bin < RAMP_TABLE_BINS; ui8_speed_bin++) {
+    for (ui8_cadence_bin = 0; ui8_cadence_bin < RAMP_TABLE_BINS; ui8_cadence_bin++) {
+      // faster acceleration of wheel speed and cadence, the values are linear with the bin
+      ui8_bin = ui8_max(ui8_speed_bin, ui8_cadence_bin);
+      
+      ui8_ramp_up_table[ui8_speed_bin][ui8_cadence_bin] = map_ui8(ui8_bin,
+          (uint8_t) 0,
+          (uint8_t) (RAMP_TABLE_BINS - 1),
+          (uint8_t) ui8_duty_cycle_ramp_up_inverse_step_default,
+          (uint8_t) PWM_DUTY_CYCLE_RAMP_UP_INVERSE_STEP_MIN);
+          
+      ui8_ramp_down_table[ui8_speed_bin][ui8_cadence_bin] = map_ui8(ui8_bin,
+          (uint8_t) 0,
+          (uint8_t) (RAMP_TABLE_BINS - 1),
+          (uint8_t) PWM_DUTY_CYCLE_RAMP_DOWN_INVERSE_STEP_DEFAULT,
+          (uint8_t) PWM_DUTY_CYCLE_RAMP_DOWN_INVERSE_STEP_MIN);
+    }
+    
+    ui8_ramp_up_throttle_table[ui8_speed_bin] = map_ui8(ui8_speed_bin,
+        (uint8_t) 0,
+        (uint8_t) (RAMP_TABLE_BINS - 1),
+        (uint8_t) THROTTLE_DUTY_CYCLE_RAMP_UP_INVERSE_STEP_DEFAULT,
+        (uint8_t) THROTTLE_DUTY_CYCLE_RAMP_UP_INVERSE_STEP_MIN);
+  }
+}
+
+
+
+static uint8_t get_ramp_speed_bin(void)
+{
+  uint16_t ui16_bin;
+  
+  if (ui16_wheel_speed_x10 <= ui16_ramp_speed_min_x10) { return 0; }
+  if (ui16_wheel_speed_x10 >= ui16_ramp_speed_max_x10) { return RAMP_TABLE_BINS - 1; }
+  
+  // nearest bin
+  ui16_bin = (uint16_t) ((((uint32_t) (ui16_wheel_speed_x10 - ui16_ramp_speed_min_x10) * ui16_ramp_speed_bins_q16) + 32768U) >> 16);
+  return (uint8_t) ui16_bin;
+}
+
+
+
+static void set_motor_acceleration(void)
+{
+  uint8_t ui8_speed_bin = get_ramp_speed_bin();
+  uint8_t ui8_cadence_bin;
+  
+  if (ui8_pedal_cadence_RPM <= ui8_ramp_cadence_min) { ui8_cadence_bin = 0; }
+  else if (ui8_pedal_cadence_RPM >= ui8_ramp_cadence_max) { ui8_cadence_bin = RAMP_TABLE_BINS - 1; }
+  else { ui8_cadence_bin = (uint8_t) ((((uint32_t) (uint8_t) (ui8_pedal_cadence_RPM - ui8_ramp_cadence_min) * ui16_ramp_cadence_bins_q16) + 32768U) >> 16); }
+  
+  ui8_duty_cycle_ramp_up_inverse_step = ui8_ramp_up_table[ui8_speed_bin][ui8_cadence_bin];
+  ui8_duty_cycle_ramp_down_inverse_step = ui8_ramp_down_table[ui8_speed_bin][ui8_cadence_bin];
+  
+  /*------------------------------------------------------------------------
+  
+    NOTE: regarding the motor acceleration tables
+    
+    The ramp inverse steps are looked up in tables of wheel speed bins and
+    cadence bins, from the default (slow) in the first bin to the min (fast) 
+    in the last bin. The faster of wheel speed and cadence is used as it 
+    was with the min of the two maps. The tables are only calculated when 
+    the motor acceleration setting or the bins range change.
+    
+  ------------------------------------------------------------------------*/
+}
+
+
+
 static void apply_power_assist()
 {
   #define TORQUE_ASSIST_FACTOR_DENOMINATOR      (uint8_t)90   // scale the torque assist target current
+  #define TORQUE_ASSIST_FACTOR_RECIPROCAL_Q16   (uint16_t)((65536UL / TORQUE_ASSIST_FACTOR_DENOMINATOR) + 1)
   
   uint8_t  ui8_tmp;
   uint16_t ui16_adc_battery_current_target_power_assist;
@@ -330,10 +679,13 @@ static void apply_power_assist()
   if (ui16_adc_pedal_torque_delta > (90 - ui8_assist_without_pedal_rotation_threshold)) { ui8_pedal_cadence_RPM = 1;}
 	}
 	
-    //soft start feature
-  if (ui8_soft_start_feature_enabled && !ui16_wheel_speed_x10){ 
-      ui8_power_assist_multiplier_x10 = ui8_riding_mode_parameter_power_soft_start;
-      ui8_torque_assist_factor = ui8_riding_mode_parameter_torque_soft_start;
+  // soft start feature, launch profile from standstill
+  if (ui8_soft_start_feature_enabled) {
+      uint16_t ui16_launch_x256 = get_launch_profile_x256();
+      ui8_power_assist_multiplier_x10 = (uint8_t) (((uint16_t) ui8_riding_mode_parameter_power_soft_start * ui16_launch_x256 +
+          (uint16_t) ui8_riding_mode_parameter_power * (256U - ui16_launch_x256)) >> 8);
+      ui8_torque_assist_factor = (uint8_t) (((uint16_t) ui8_riding_mode_parameter_torque_soft_start * ui16_launch_x256 +
+          (uint16_t) ui8_riding_mode_parameter_torque * (256U - ui16_launch_x256)) >> 8);
   }else{
 	// get the torque assist factor
       ui8_power_assist_multiplier_x10 = ui8_riding_mode_parameter_power;
@@ -342,7 +694,25 @@ static void apply_power_assist()
   }
   
   // calculate power assist by multipling human power with the power assist multiplier
-  uint32_t ui32_power_assist_x100 = ((uint32_t) ui16_pedal_torque_x100 * ui8_pedal_cadence_RPM * ui8_power_assist_multiplier_x10) / 96U; 
+  // cadence with 0.1 RPM resolution, unless set by assist without pedal rotation
+  uint16_t ui16_pedal_cadence_RPM_x10_assist = ui16_pedal_cadence_RPM_x10 ? ui16_pedal_cadence_RPM_x10 : (uint16_t) ui8_pedal_cadence_RPM * 10U;
+  uint32_t ui32_human_power_x100 = mul_u32_q16((uint32_t) ui16_pedal_torque_x100 * ui16_pedal_cadence_RPM_x10_assist, HUMAN_POWER_X100_PER_TORQUE_CADENCE_Q16);
+  uint32_t ui32_power_assist_x100;
+  
+  if (m_assist_curves[ASSIST_CURVE_POWER].ui8_nr_points >= ASSIST_CURVE_NR_POINTS_MIN) {
+    // assist power from the curve of human power in W
+    uint16_t ui16_human_power_assist = ui16_sat_u32(ui32_human_power_x100 / 100U); // no reciprocal is exact over the 32 bit range
+    ui32_power_assist_x100 = (uint32_t) curve_evaluate(&m_assist_curves[ASSIST_CURVE_POWER], ui16_human_power_assist) * ui8_power_assist_multiplier_x10 * 10U;
+  } else {
+    ui32_power_assist_x100 = mul_u32_q16(ui32_human_power_x100 * ui8_power_assist_multiplier_x10, DIVIDE_BY_10_Q16);
+  }
+  
+  // more assist when climbing, from the estimated grade
+  if (ui8_road_load_assist_boost && (i16_road_grade_x10 > 0)) {
+    uint16_t ui16_assist_boost = ui16_sat_u32(mul_u32_q16((uint32_t) i16_road_grade_x10 * ui8_road_load_assist_boost, DIVIDE_BY_10_Q16));
+    if (ui16_assist_boost > ui8_road_load_assist_boost_max) { ui16_assist_boost = ui8_road_load_assist_boost_max; }
+    ui32_power_assist_x100 += (ui32_power_assist_x100 >> 8) * DIVIDE_BY_100_U16(ui16_assist_boost << 8);
+  }
   
   /*------------------------------------------------------------------------
 
@@ -357,18 +727,21 @@ static void apply_power_assist()
     
   ------------------------------------------------------------------------*/  
   
-  // calculate target current
-  uint16_t ui16_battery_current_target_x100 = (uint16_t)((ui32_power_assist_x100 * 1000) / ui16_battery_voltage_filtered_x1000);
-  
-  // set battery current target power assist in ADC steps
-  ui16_adc_battery_current_target_power_assist = ui16_battery_current_target_x100 / BATTERY_CURRENT_PER_10_BIT_ADC_STEP_X100;
+  // set battery current target power assist in ADC steps, with the battery voltage reciprocal
+  ui16_adc_battery_current_target_power_assist = ui16_sat_u32(mul_u32_q16(ui32_power_assist_x100, ui16_adc_battery_current_per_power_x100_q22) >> 6);
 
   //apply torque assist if hybrid mode enabled
   if (ui8_hybrid_mode_enabled && ui16_adc_pedal_torque_delta && ui8_pedal_cadence_RPM){
   
-  if (ui8_torque_linearization_enabled){ui16_adc_pedal_torque_delta = ui16_pedal_torque_x100 / 100;}
+  if (ui8_torque_linearization_enabled){ui16_adc_pedal_torque_delta = ui16_pedal_torque_x100 / 100U;}
+  // shape the pedal torque with the curve if in use
+  uint16_t ui16_torque_assist = ui16_adc_pedal_torque_delta;
+  if (m_assist_curves[ASSIST_CURVE_TORQUE].ui8_nr_points >= ASSIST_CURVE_NR_POINTS_MIN) {
+    ui16_torque_assist = curve_evaluate(&m_assist_curves[ASSIST_CURVE_TORQUE], ui16_adc_pedal_torque_delta);
+  }
+  
   // calculate torque assist target current
-  ui16_adc_battery_current_target_torque_assist = ((uint16_t) ui16_adc_pedal_torque_delta * ui8_torque_assist_factor) / TORQUE_ASSIST_FACTOR_DENOMINATOR;
+  ui16_adc_battery_current_target_torque_assist = ui16_sat_u32(mul_u32_q16((uint32_t) ui16_torque_assist * ui8_torque_assist_factor, TORQUE_ASSIST_FACTOR_RECIPROCAL_Q16));
   }else{
   ui16_adc_battery_current_target_torque_assist = 0;}
   	
@@ -379,38 +752,8 @@ static void apply_power_assist()
 		ui16_adc_battery_current_target = ui16_adc_battery_current_target_torque_assist;}
 		
   
- // set motor acceleration
-    if (ui16_wheel_speed_x10 >= 200) {
-        ui8_duty_cycle_ramp_up_inverse_step = PWM_DUTY_CYCLE_RAMP_UP_INVERSE_STEP_MIN;
-        ui8_duty_cycle_ramp_down_inverse_step = PWM_DUTY_CYCLE_RAMP_DOWN_INVERSE_STEP_MIN;
-    } else {
-            ui8_duty_cycle_ramp_up_inverse_step = map_ui8((uint8_t)(ui16_wheel_speed_x10>>2),
-                    (uint8_t)10, // 10*4 = 40 -> 4 kph
-                    (uint8_t)60, // 60*4 = 200 -> 24 kph
-                    (uint8_t)ui8_duty_cycle_ramp_up_inverse_step_default,
-                    (uint8_t)PWM_DUTY_CYCLE_RAMP_UP_INVERSE_STEP_MIN);
-            ui8_tmp = map_ui8(ui8_pedal_cadence_RPM,
-                    (uint8_t)20, // 20 rpm
-                    (uint8_t)90, // 90 rpm
-                    (uint8_t)ui8_duty_cycle_ramp_up_inverse_step_default,
-                    (uint8_t)PWM_DUTY_CYCLE_RAMP_UP_INVERSE_STEP_MIN);
-            
-		if (ui8_tmp < ui8_duty_cycle_ramp_up_inverse_step)
-                ui8_duty_cycle_ramp_up_inverse_step = ui8_tmp;
-
-        ui8_duty_cycle_ramp_down_inverse_step = map_ui8((uint8_t)(ui16_wheel_speed_x10>>2),
-                (uint8_t)10, // 10*4 = 40 -> 4 kph
-                (uint8_t)60, // 60*4 = 200 -> 24 kph
-                (uint8_t)PWM_DUTY_CYCLE_RAMP_DOWN_INVERSE_STEP_DEFAULT,
-                (uint8_t)PWM_DUTY_CYCLE_RAMP_DOWN_INVERSE_STEP_MIN);
-        ui8_tmp = map_ui8(ui8_pedal_cadence_RPM,
-                (uint8_t)20, // 20 rpm
-                (uint8_t)90, // 90 rpm
-                (uint8_t)PWM_DUTY_CYCLE_RAMP_DOWN_INVERSE_STEP_DEFAULT,
-                (uint8_t)PWM_DUTY_CYCLE_RAMP_DOWN_INVERSE_STEP_MIN);
-        if (ui8_tmp < ui8_duty_cycle_ramp_down_inverse_step)
-            ui8_duty_cycle_ramp_down_inverse_step = ui8_tmp;
-    }
+  // set motor acceleration from wheel speed and cadence
+  set_motor_acceleration();
 
 
     // add field weakening current 
@@ -442,6 +785,129 @@ static void apply_power_assist()
 
 
 
+static void apply_motor_torque_assist()
+{
+  uint8_t  ui8_tmp;
+  uint16_t ui16_adc_motor_phase_current_target = 0;
+  uint16_t ui16_adc_battery_current_target;
+  
+  // check for assist without pedal rotation threshold when there is no pedal rotation and standing still
+  if (ui8_assist_without_pedal_rotation_threshold && !ui8_pedal_cadence_RPM)
+  {
+    if (ui16_adc_pedal_torque_delta > (90 - ui8_assist_without_pedal_rotation_threshold)) { ui8_pedal_cadence_RPM = 1; }
+  }
+  
+  if (ui8_pedal_cadence_RPM) {
+    // motor torque at the crank, rider torque times the assist ratio x10
+    uint32_t ui32_motor_torque_x100 = mul_u32_q16((uint32_t) ui16_pedal_torque_x100 * ui8_riding_mode_parameter, DIVIDE_BY_10_Q16);
+    
+    // phase current from the motor torque constant
+    ui16_adc_motor_phase_current_target = ui16_sat_u32(mul_u32_q16(ui32_motor_torque_x100, ui16_motor_phase_current_per_torque_x100_q16));
+  }
+  
+  // battery current for the phase current at the actual duty cycle, see NOTE in main.h
+  ui16_adc_battery_current_target = ui16_sat_u32(mul_u32_q16((uint32_t) ui16_adc_motor_phase_current_target * ui8_max(ui8_g_duty_cycle, PWM_DUTY_CYCLE_STARTUP),
+      (uint16_t) ((65536UL / PWM_DUTY_CYCLE_MAX) + 1)));
+  
+  // set motor acceleration from wheel speed and cadence
+  set_motor_acceleration();
+
+
+  // add field weakening current
+  if (ui8_field_weakening_enabled && ui8_field_weakening_current_adc && ui16_adc_battery_current_target) {
+    ui8_tmp = map_ui8(ui8_fw_hall_counter_offset,
+            (uint8_t)2,                               // min fw angle - don't add current on low rpm
+            (uint8_t)FW_HALL_COUNTER_OFFSET_MAX - 1,  // max FW angle
+            (uint8_t)0,
+            (uint8_t)ui8_field_weakening_current_adc);
+
+    ui16_adc_battery_current_target = ui16_adc_battery_current_target + ui8_tmp;
+  }
+
+  // set battery current target
+  if (ui16_adc_battery_current_target > ui8_adc_battery_current_max) { ui8_adc_battery_current_target = ui8_adc_battery_current_max; }
+  else { ui8_adc_battery_current_target = ui16_adc_battery_current_target; }
+
+  // keep min current for faster motor engage
+  if ((ui8_adc_battery_current_min) && (ui16_wheel_speed_x10 || ui8_pedal_cadence_RPM) && (!ui8_adc_battery_current_target))
+  {
+    ui8_adc_battery_current_target = ui8_adc_battery_current_min;
+  }
+
+  // set duty cycle target
+  if (ui8_adc_battery_current_target) { ui8_duty_cycle_target = PWM_DUTY_CYCLE_MAX; }
+  else { ui8_duty_cycle_target = 0; }
+}
+
+
+
+static void set_launch_profile(uint8_t ui8_crank_revolutions, uint8_t ui8_time_x10)
+{
+  // progress steps x65536 for a full launch, 0 when not used
+  ui16_launch_crank_step_q16 = ui8_crank_revolutions ? (uint16_t) (65535U / ((uint16_t) ui8_crank_revolutions * CRANK_SECTORS)) : 0;
+  ui16_launch_time_step_q16 = ui8_time_x10 ? (uint16_t) (65535U / ((uint16_t) ui8_time_x10 * 4U)) : 0;
+}
+
+
+
+static uint16_t get_launch_profile_x256(void)
+{
+  static uint32_t ui32_crank_revolutions_x20_launch;
+  static uint32_t ui32_time_progress;
+  uint32_t ui32_crank_revolutions_x20_now;
+  uint32_t ui32_crank_progress;
+  
+  disableInterrupts();
+  ui32_crank_revolutions_x20_now = ui32_crank_revolutions_x20;
+  enableInterrupts();
+  
+  // armed at standstill with the crank stopped, also with weight on a pedal waiting at a traffic light
+  if ((ui16_wheel_speed_x10 < LAUNCH_SPEED_STANDSTILL_X10) && !ui8_pedal_cadence_RPM) {
+    ui8_launch_active = 1;
+    ui32_crank_revolutions_x20_launch = ui32_crank_revolutions_x20_now;
+    ui32_time_progress = 0;
+    return 256;
+  }
+  
+  if (!ui8_launch_active) { return 0; }
+  
+  // launch ends after the crank revolutions or the time, whichever comes first,
+  // both counted from when the crank turns or the bike moves
+  ui32_crank_revolutions_x20_now -= ui32_crank_revolutions_x20_launch;
+  if (ui32_crank_revolutions_x20_now > 255) { ui32_crank_revolutions_x20_now = 255; }
+  ui32_crank_progress = ui32_crank_revolutions_x20_now * ui16_launch_crank_step_q16;
+  ui32_time_progress += ui16_launch_time_step_q16;
+  
+  uint32_t ui32_progress = (ui32_crank_progress > ui32_time_progress) ? ui32_crank_progress : ui32_time_progress;
+  
+  if ((ui32_progress >= 65535U) || (!ui16_launch_crank_step_q16 && !ui16_launch_time_step_q16)) {
+    ui8_launch_active = 0;
+    return 0;
+  }
+  
+  /*------------------------------------------------------------------------
+
+    NOTE: regarding the launch profile
+
+    Soft start levels are held for the first part of the launch,
+    then blended linearly into the normal assist levels:
+
+    progress (x256) = max(crank revolutions x20 / (revolutions * 20), time / T)
+    soft start weight = 256 - (progress - hold) * 256 / (256 - hold)
+
+    There is no step at the hand-over, the weight is already 0.
+
+  ------------------------------------------------------------------------*/
+  
+  uint8_t ui8_progress_x256 = (uint8_t) (ui32_progress >> 8);
+  if (ui8_progress_x256 <= ui8_launch_hold_x256) { return 256; }
+  
+  uint16_t ui16_fade_x256 = (uint16_t) (((uint32_t) (ui8_progress_x256 - ui8_launch_hold_x256) * ui16_launch_fade_x256) >> 8);
+  return (ui16_fade_x256 < 256) ? (256 - ui16_fade_x256) : 0;
+}
+
+
+
 static void apply_emtb_assist()
 {
   #define eMTB_ASSIST_ADC_TORQUE_OFFSET    10
@@ -454,64 +920,38 @@ static void apply_emtb_assist()
   }
   
   if ((ui16_adc_pedal_torque_delta > 0) && 
-      (ui16_adc_pedal_torque_delta < (eMTB_POWER_FUNCTION_ARRAY_SIZE - eMTB_ASSIST_ADC_TORQUE_OFFSET)) &&
+      (ui16_adc_pedal_torque_delta < (eMTB_POWER_FUNCTION_X_MAX + 1 - eMTB_ASSIST_ADC_TORQUE_OFFSET)) &&
       (ui8_pedal_cadence_RPM))
   {
     // initialize eMTB assist target current
     uint8_t ui8_adc_battery_current_target_eMTB_assist = 0;
     
-    // get the eMTB assist sensitivity
+    // get the eMTB assist sensitivity: 1 to 10 are the legacy levels, 100 to 255 is the exponent x100
     uint8_t ui8_eMTB_assist_sensitivity = ui8_riding_mode_parameter;
-
-																									  
-  
-    switch (ui8_eMTB_assist_sensitivity)
-    {
-      case 1: ui8_adc_battery_current_target_eMTB_assist = ui8_eMTB_power_function_160[ui16_adc_pedal_torque_delta]; break;
-      case 2: ui8_adc_battery_current_target_eMTB_assist = ui8_eMTB_power_function_165[ui16_adc_pedal_torque_delta]; break;
-      case 3: ui8_adc_battery_current_target_eMTB_assist = ui8_eMTB_power_function_170[ui16_adc_pedal_torque_delta]; break;
-      case 4: ui8_adc_battery_current_target_eMTB_assist = ui8_eMTB_power_function_175[ui16_adc_pedal_torque_delta]; break;
-      case 5: ui8_adc_battery_current_target_eMTB_assist = ui8_eMTB_power_function_180[ui16_adc_pedal_torque_delta]; break;
-      case 6: ui8_adc_battery_current_target_eMTB_assist = ui8_eMTB_power_function_195[ui16_adc_pedal_torque_delta]; break;
-      case 7: ui8_adc_battery_current_target_eMTB_assist = ui8_eMTB_power_function_210[ui16_adc_pedal_torque_delta]; break;
-      case 8: ui8_adc_battery_current_target_eMTB_assist = ui8_eMTB_power_function_225[ui16_adc_pedal_torque_delta]; break;
-      case 9: ui8_adc_battery_current_target_eMTB_assist = ui8_eMTB_power_function_240[ui16_adc_pedal_torque_delta]; break;
-      case 10: ui8_adc_battery_current_target_eMTB_assist = ui8_eMTB_power_function_255[ui16_adc_pedal_torque_delta]; break;
+    
+    if ((ui8_eMTB_assist_sensitivity >= 1) && (ui8_eMTB_assist_sensitivity <= 10)) {
+      ui8_eMTB_assist_sensitivity = ui8_eMTB_legacy_exponent_x100[ui8_eMTB_assist_sensitivity - 1];
+    } else if (ui8_eMTB_assist_sensitivity < 100) {
+      ui8_eMTB_assist_sensitivity = 0;
     }
-
-    // set motor acceleration
-    if (ui16_wheel_speed_x10 >= 200) {
-            ui8_duty_cycle_ramp_up_inverse_step = PWM_DUTY_CYCLE_RAMP_UP_INVERSE_STEP_MIN;
-            ui8_duty_cycle_ramp_down_inverse_step = PWM_DUTY_CYCLE_RAMP_DOWN_INVERSE_STEP_MIN;
-    } else {
-            ui8_duty_cycle_ramp_up_inverse_step = map_ui8((uint8_t)(ui16_wheel_speed_x10>>2),
-                    (uint8_t)10, // 10*4 = 40 -> 4 kph
-                    (uint8_t)60, // 60*4 = 200 -> 24 kph
-                    (uint8_t)ui8_duty_cycle_ramp_up_inverse_step_default,
-                    (uint8_t)PWM_DUTY_CYCLE_RAMP_UP_INVERSE_STEP_MIN);
-            ui8_tmp = map_ui8(ui8_pedal_cadence_RPM,
-                    (uint8_t)20, // 20 rpm
-                    (uint8_t)90, // 90 rpm
-                    (uint8_t)ui8_duty_cycle_ramp_up_inverse_step_default,
-                    (uint8_t)PWM_DUTY_CYCLE_RAMP_UP_INVERSE_STEP_MIN);
-    
-	if (ui8_tmp < ui8_duty_cycle_ramp_up_inverse_step)
-        ui8_duty_cycle_ramp_up_inverse_step = ui8_tmp;
-
-            ui8_duty_cycle_ramp_down_inverse_step = map_ui8((uint8_t)(ui16_wheel_speed_x10>>2),
-                    (uint8_t)10, // 10*4 = 40 -> 4 kph
-                    (uint8_t)60, // 60*4 = 240 -> 24 kph
-                    (uint8_t)PWM_DUTY_CYCLE_RAMP_DOWN_INVERSE_STEP_DEFAULT,
-                    (uint8_t)PWM_DUTY_CYCLE_RAMP_DOWN_INVERSE_STEP_MIN);
-            ui8_tmp = map_ui8(ui8_pedal_cadence_RPM,
-                    (uint8_t)20, // 20 rpm
-                    (uint8_t)90, // 90 rpm
-                    (uint8_t)PWM_DUTY_CYCLE_RAMP_DOWN_INVERSE_STEP_DEFAULT,
-                    (uint8_t)PWM_DUTY_CYCLE_RAMP_DOWN_INVERSE_STEP_MIN);
-    if (ui8_tmp < ui8_duty_cycle_ramp_down_inverse_step)
-        ui8_duty_cycle_ramp_down_inverse_step = ui8_tmp;
+    
+    if (m_assist_curves[ASSIST_CURVE_eMTB].ui8_nr_points >= ASSIST_CURVE_NR_POINTS_MIN) {
+      // target current from the curve
+      uint16_t ui16_eMTB_assist = curve_evaluate(&m_assist_curves[ASSIST_CURVE_eMTB], ui16_adc_pedal_torque_delta);
+      ui8_adc_battery_current_target_eMTB_assist = (ui16_eMTB_assist > 255) ? 255 : (uint8_t) ui16_eMTB_assist;
+    } else if (ui8_eMTB_assist_sensitivity) {
+      // exponent x4096, only calculated when changed
+      if (ui8_eMTB_assist_sensitivity != ui8_eMTB_exponent_x100) {
+        ui8_eMTB_exponent_x100 = ui8_eMTB_assist_sensitivity;
+        ui16_eMTB_exponent_x4096 = (uint16_t) ((((uint32_t) ui8_eMTB_assist_sensitivity << 12) + 50U) / 100U);
+      }
+      
+      ui8_adc_battery_current_target_eMTB_assist = get_emtb_power_function((uint8_t) ui16_adc_pedal_torque_delta, ui16_eMTB_exponent_x4096);
     }
-		
+
+    // set motor acceleration from wheel speed and cadence
+    set_motor_acceleration();
+
 
     // add field weakening current 
     if (ui8_field_weakening_enabled && ui8_field_weakening_current_adc){
@@ -541,6 +981,58 @@ static void apply_emtb_assist()
 }
 
 
+static uint8_t get_emtb_power_function(uint8_t ui8_x, uint16_t ui16_exponent_x4096)
+{
+  uint32_t ui32_log2_x4096;
+  uint16_t ui16_mantissa;
+  uint16_t ui16_y_x16384;
+  uint8_t ui8_index;
+  uint8_t ui8_n = 7;
+  
+  if (!ui8_x) { return 0; }
+  
+  // log2(x) x4096: exponent from the MSB position, mantissa from the table with linear interpolation
+  while (!(ui8_x & 0x80)) {
+    ui8_x <<= 1;
+    ui8_n--;
+  }
+  ui16_mantissa = (uint16_t) (ui8_x & 0x7f) << 1;       // 1/256 steps
+  ui8_index = (uint8_t) (ui16_mantissa >> 3);
+  ui32_log2_x4096 = ((uint32_t) ui8_n << 12) + ui16_log2_table[ui8_index] +
+      ((uint16_t) (ui16_log2_table[ui8_index + 1] - ui16_log2_table[ui8_index]) * (ui16_mantissa & 7) >> 3);
+  
+  // log2(y x256) = exponent * log2(x) - log2(100) + 8
+  ui32_log2_x4096 = ((ui32_log2_x4096 * ui16_exponent_x4096) >> 12) + ((uint32_t) 8U << 12);
+  if (ui32_log2_x4096 < eMTB_POWER_FUNCTION_LOG2_100_X4096) { return 0; }
+  ui32_log2_x4096 -= eMTB_POWER_FUNCTION_LOG2_100_X4096;
+  
+  // y over 256
+  if (ui32_log2_x4096 >= ((uint32_t) 16U << 12)) { return eMTB_POWER_FUNCTION_Y_MAX; }
+  
+  // 2^x: fraction from the table with linear interpolation, then shift
+  ui8_index = (uint8_t) ((ui32_log2_x4096 >> 7) & 31);
+  ui16_y_x16384 = ui16_exp2_table[ui8_index] +
+      (uint16_t) (((uint32_t) (ui16_exp2_table[ui8_index + 1] - ui16_exp2_table[ui8_index]) * (ui32_log2_x4096 & 127)) >> 7);
+  
+  // y = round(y x256 / 256)
+  ui32_log2_x4096 = (((uint32_t) ui16_y_x16384 << (uint8_t) (ui32_log2_x4096 >> 12)) >> 14) + 128U;
+  ui16_mantissa = (uint16_t) (ui32_log2_x4096 >> 8);
+  
+  if (ui16_mantissa > eMTB_POWER_FUNCTION_Y_MAX) { return eMTB_POWER_FUNCTION_Y_MAX; }
+  return (uint8_t) ui16_mantissa;
+  
+      /*-------------------------------------------------------------------------------------------------
+      
+        NOTE: regarding the eMTB power function
+        y = x ^ exponent / 100, limited to 240. It replaces the ten 241 bytes tables (exponents 1.60,
+        1.65, 1.70, 1.75, 1.80, 1.95, 2.10, 2.25, 2.40, 2.55) within +-1 and any exponent can be used.
+        Calculated as 2 ^ (exponent * log2(x) - log2(100)) with log2 and 2^x tables of 33 points.
+        
+      -------------------------------------------------------------------------------------------------*/
+}
+
+
+
 
 static void apply_calibration_assist() {
     // ui8_riding_mode_parameter contains the target duty cycle
@@ -569,13 +1061,60 @@ static void apply_walk_assist()
   #define WALK_ASSIST_DUTY_CYCLE_MAX                      80
   #define WALK_ASSIST_ADC_BATTERY_CURRENT_MAX             80
   
+  static int16_t  i16_integral_x256;
+  static uint16_t ui16_speed_target_x256;     // km/h x10 x256, soft start ramp
+  static uint8_t  ui8_stall_counter;
+  static uint8_t  ui8_stalled;
+  
   if (ui16_wheel_speed_x10 < WALK_ASSIST_THRESHOLD_SPEED_X10)
   {
-    // get the walk assist duty cycle target
-    uint8_t ui8_walk_assist_duty_cycle_target = ui8_riding_mode_parameter;
+    // walking speed from the motor speed, it changes at every Hall sensor transition while the wheel speed sensor is too slow
+    uint16_t ui16_walk_speed_x10 = (uint16_t) (((uint32_t) ui16_motor_speed_erps * ui16_wheel_speed_motor_ratio_x256) >> 8);
+    if (ui16_wheel_speed_sensor_x10 > ui16_walk_speed_x10) { ui16_walk_speed_x10 = ui16_wheel_speed_sensor_x10; }
     
-    // check so that walk assist level factor is not too large (too powerful), if it is -> limit the value
-    if (ui8_walk_assist_duty_cycle_target > WALK_ASSIST_DUTY_CYCLE_MAX) { ui8_walk_assist_duty_cycle_target = WALK_ASSIST_DUTY_CYCLE_MAX; }
+    // get the walk assist target speed in km/h x10
+    uint16_t ui16_walk_speed_target_x10 = ui8_riding_mode_parameter;
+    if (ui16_walk_speed_target_x10 > WALK_ASSIST_THRESHOLD_SPEED_X10) { ui16_walk_speed_target_x10 = WALK_ASSIST_THRESHOLD_SPEED_X10; }
+    
+    // soft start from the actual speed, bumpless from the actual duty cycle
+    if (ui8_walk_assist_initialize) {
+      ui8_walk_assist_initialize = 0;
+      ui16_speed_target_x256 = ui16_walk_speed_x10 << 8;
+      i16_integral_x256 = (int16_t) ((uint16_t) ui8_min(ui8_g_duty_cycle, WALK_ASSIST_DUTY_CYCLE_MAX) << 8);
+      ui8_stall_counter = 0;
+      ui8_stalled = 0;
+    }
+    
+    if ((ui16_speed_target_x256 >> 8) < ui16_walk_speed_target_x10) {
+      ui16_speed_target_x256 += WALK_ASSIST_SPEED_TARGET_RAMP_X256;
+    } else {
+      ui16_speed_target_x256 = ui16_walk_speed_target_x10 << 8;
+    }
+    
+    // speed PI, the integral finds the duty cycle needed on a ramp
+    int16_t i16_error = (int16_t) (ui16_speed_target_x256 >> 8) - (int16_t) ui16_walk_speed_x10;
+    int16_t i16_output_x256;
+    int32_t i32_output_x256;
+    
+    i32_output_x256 = (int32_t) i16_integral_x256 + ((int32_t) WALK_ASSIST_PI_KI_X256 * i16_error);
+    if (i32_output_x256 < 0) { i32_output_x256 = 0; }
+    else if (i32_output_x256 > ((int32_t) WALK_ASSIST_DUTY_CYCLE_MAX << 8)) { i32_output_x256 = (int32_t) WALK_ASSIST_DUTY_CYCLE_MAX << 8; }
+    i16_integral_x256 = (int16_t) i32_output_x256;
+    
+    i32_output_x256 += (int32_t) WALK_ASSIST_PI_KP_X256 * i16_error;
+    if (i32_output_x256 < 0) { i32_output_x256 = 0; }
+    else if (i32_output_x256 > ((int32_t) WALK_ASSIST_DUTY_CYCLE_MAX << 8)) { i32_output_x256 = (int32_t) WALK_ASSIST_DUTY_CYCLE_MAX << 8; }
+    i16_output_x256 = (int16_t) i32_output_x256;
+    
+    // stall guard: motor not turning with enough duty cycle, stop until walk assist is selected again
+    if ((ui16_motor_speed_erps <= WALK_ASSIST_STALL_ERPS_MAX) && (ui8_g_duty_cycle >= WALK_ASSIST_STALL_DUTY_CYCLE_MIN)) {
+      if (ui8_stall_counter < WALK_ASSIST_STALL_CYCLES) { ui8_stall_counter++; }
+      else { ui8_stalled = 1; }
+    } else {
+      ui8_stall_counter = 0;
+    }
+    
+    if (ui8_stalled) { return; }
     
     // set motor acceleration
     ui8_duty_cycle_ramp_up_inverse_step = WALK_ASSIST_DUTY_CYCLE_RAMP_UP_INVERSE_STEP;
@@ -585,35 +1124,50 @@ static void apply_walk_assist()
     ui8_adc_battery_current_target = ui8_min(WALK_ASSIST_ADC_BATTERY_CURRENT_MAX, ui8_adc_battery_current_max);
     
     // set duty cycle target
-    ui8_duty_cycle_target = ui8_walk_assist_duty_cycle_target;
+    ui8_duty_cycle_target = (uint8_t) (i16_output_x256 >> 8);
   }
+  
+  /*------------------------------------------------------------------------
+  
+    NOTE: regarding the walk assist
+    
+    The riding mode parameter is the walking speed in km/h x10, up to the
+    walk assist threshold speed. The duty cycle is regulated with a PI on
+    the speed from the motor ERPS and the learned drivetrain ratio, so the 
+    speed stays the same on a ramp. The target speed ramps up from the 
+    actual speed and walk assist stops if the motor is blocked for a second.
+    
+  ------------------------------------------------------------------------*/
 }
 
 
 
+
 static void apply_cruise()
 {
-#define CRUISE_PID_INTEGRAL_LIMIT                 1000
-#define CRUISE_PID_KD                             0
+#define CRUISE_PID_OUTPUT_MAX_X256                ((int32_t) (PWM_DUTY_CYCLE_MAX - 1) << 8)
 
     if (ui16_wheel_speed_x10 > CRUISE_THRESHOLD_SPEED_X10) {
-        static int16_t i16_error;
-        static int16_t i16_last_error;
-        static int16_t i16_integral;
-        static int16_t i16_derivative;
-        static int16_t i16_control_output;
+        static int32_t i32_integral_x256;
+        static int16_t i16_speed_delta_x16;
+        static uint16_t ui16_wheel_speed_old_x10;
         static uint16_t ui16_wheel_speed_target_x10;
+        int16_t i16_error;
+        int16_t i16_speed_delta;
+        int32_t i32_proportional_x256;
+        int32_t i32_derivative_x256;
+        int32_t i32_feedforward_x256;
+        int32_t i32_integral_new_x256;
+        int32_t i32_control_output_x256;
+        uint8_t ui8_initialize = ui8_cruise_PID_initialize;
 
         // initialize cruise PID controller
         if (ui8_cruise_PID_initialize) {
             ui8_cruise_PID_initialize = 0;
 
-            // reset PID variables
-            i16_error = 0;
-            i16_last_error = 0;
-            i16_integral = 320; // initialize integral to a value so the motor does not start from zero
-            i16_derivative = 0;
-            i16_control_output = 0;
+            // reset derivative
+            i16_speed_delta_x16 = 0;
+            ui16_wheel_speed_old_x10 = ui16_wheel_speed_x10;
 
             // check what target wheel speed to use (received or current)
             ui16_wheel_speed_target_received_x10 = (uint16_t) ui8_riding_mode_parameter * 10;
@@ -627,352 +1181,1426 @@ static void apply_cruise()
             }
         }
 
-        // calculate error
-        i16_error = (ui16_wheel_speed_target_x10 - ui16_wheel_speed_x10);
+        // calculate error
+        i16_error = (int16_t) (ui16_wheel_speed_target_x10 - ui16_wheel_speed_x10);
+        i32_proportional_x256 = (int32_t) ui16_cruise_pid_kp_x256 * i16_error;
+
+        // derivative on the filtered measured speed, no kick when the target changes
+        i16_speed_delta = (int16_t) (ui16_wheel_speed_x10 - ui16_wheel_speed_old_x10);
+        ui16_wheel_speed_old_x10 = ui16_wheel_speed_x10;
+
+        if (i16_speed_delta > CRUISE_PID_DERIVATIVE_SPEED_DELTA_MAX) { i16_speed_delta = CRUISE_PID_DERIVATIVE_SPEED_DELTA_MAX; }
+        else if (i16_speed_delta < -CRUISE_PID_DERIVATIVE_SPEED_DELTA_MAX) { i16_speed_delta = -CRUISE_PID_DERIVATIVE_SPEED_DELTA_MAX; }
+
+        i16_speed_delta_x16 += ((i16_speed_delta << 4) - i16_speed_delta_x16) >> CRUISE_PID_DERIVATIVE_FILTER_SHIFT;
+        i32_derivative_x256 = -(((int32_t) CRUISE_PID_KD_X256 * i16_speed_delta_x16) >> 4);
+
+        // feedforward from road load, duty cycle for the phase current resistive voltage drop
+        {
+            uint8_t ui8_duty_cycle = ui8_max(ui8_g_duty_cycle, PWM_DUTY_CYCLE_STARTUP);
+            uint16_t ui16_adc_phase_current = ((uint16_t) ui8_adc_battery_current_filtered * PWM_DUTY_CYCLE_MAX) / ui8_duty_cycle;
+            uint16_t ui16_resistance = ((m_configuration_variables.ui8_motor_type == 0) ?
+                WINDING_RESISTANCE_MILLIOHM_48V_MOTOR : WINDING_RESISTANCE_MILLIOHM_36V_MOTOR) + MOSFETS_RESISTANCE_MILLIOHM;
+
+            i32_feedforward_x256 = ui16_adc_battery_voltage_filtered ?
+                (int32_t) (((uint32_t) ui16_adc_phase_current * ui16_resistance * CRUISE_FEEDFORWARD_FACTOR) / ui16_adc_battery_voltage_filtered) : 0;
+        }
+
+        // bumpless transfer, start from the current duty cycle
+        if (ui8_initialize) {
+            i32_integral_x256 = ((int32_t) ui8_g_duty_cycle << 8) - i32_proportional_x256 - i32_feedforward_x256;
+            if (i32_integral_x256 < 0) { i32_integral_x256 = 0; }
+            else if (i32_integral_x256 > CRUISE_PID_OUTPUT_MAX_X256) { i32_integral_x256 = CRUISE_PID_OUTPUT_MAX_X256; }
+        }
+
+        // calculate control output ( output = P + I + D + feedforward )
+        i32_integral_new_x256 = i32_integral_x256 + ((int32_t) ui16_cruise_pid_ki_x256 * i16_error);
+        i32_control_output_x256 = i32_proportional_x256 + i32_integral_new_x256 + i32_derivative_x256 + i32_feedforward_x256;
+
+        // anti-windup: integrate only if the output is not saturated in the direction of the error
+        if (!(((i32_control_output_x256 > CRUISE_PID_OUTPUT_MAX_X256) && (i16_error > 0)) ||
+              ((i32_control_output_x256 < 0) && (i16_error < 0)))) {
+            i32_integral_x256 = i32_integral_new_x256;
+        }
+
+        // limit control output
+        if (i32_control_output_x256 < 0) {
+            i32_control_output_x256 = 0;
+        } else if (i32_control_output_x256 > CRUISE_PID_OUTPUT_MAX_X256) {
+            i32_control_output_x256 = CRUISE_PID_OUTPUT_MAX_X256;
+        }
+
+        // set motor acceleration
+        ui8_duty_cycle_ramp_up_inverse_step = CRUISE_DUTY_CYCLE_RAMP_UP_INVERSE_STEP;
+        ui8_duty_cycle_ramp_down_inverse_step = PWM_DUTY_CYCLE_RAMP_DOWN_INVERSE_STEP_DEFAULT;
+
+        // set battery current target
+        ui8_adc_battery_current_target = ui8_adc_battery_current_max;
+
+        // set duty cycle target
+        ui8_duty_cycle_target = (uint8_t) (i32_control_output_x256 >> 8);
+    }
+}
+
+
+
+static void apply_throttle() {
+    uint16_t ui16_throttle;
+    uint16_t ui16_adc_battery_current_target_x256;
+    uint8_t ui8_i;
+
+    // filtered 10 bit ADC value (filtered in the PWM interrupt)
+    uint16_t ui16_adc_throttle_value = ui16_adc_throttle_filtered;
+
+    // the first value is the released throttle
+    if (!ui8_throttle_calibrated) {
+        if ((ui16_adc_throttle_value > ADC_10_BIT_THROTTLE_MIN_VALUE_LIMIT) &&
+            (ui16_adc_throttle_value < ADC_10_BIT_THROTTLE_MIN_VALUE_STARTUP_MAX)) {
+            ui16_adc_throttle_min = ui16_adc_throttle_value;
+        }
+        ui8_throttle_calibrated = 1;
+    }
+
+    // learn throttle range, only from values that stay out of it (see NOTE in main.h)
+    if ((ui16_adc_throttle_value < ui16_adc_throttle_min) && (ui16_adc_throttle_value > ADC_10_BIT_THROTTLE_MIN_VALUE_LIMIT)) {
+        if ((!ui8_throttle_min_learn_counter) || (ui16_adc_throttle_value > ui16_adc_throttle_min_candidate)) {
+            ui16_adc_throttle_min_candidate = ui16_adc_throttle_value;
+        }
+        if (++ui8_throttle_min_learn_counter >= THROTTLE_LEARN_CYCLES) {
+            ui16_adc_throttle_min = ui16_adc_throttle_min_candidate;
+            ui8_throttle_min_learn_counter = 0;
+        }
+    } else {
+        ui8_throttle_min_learn_counter = 0;
+    }
+    if ((ui16_adc_throttle_value > ui16_adc_throttle_max) && (ui16_adc_throttle_value < ADC_10_BIT_THROTTLE_MAX_VALUE_LIMIT)) {
+        if ((!ui8_throttle_max_learn_counter) || (ui16_adc_throttle_value < ui16_adc_throttle_max_candidate)) {
+            ui16_adc_throttle_max_candidate = ui16_adc_throttle_value;
+        }
+        if (++ui8_throttle_max_learn_counter >= THROTTLE_LEARN_CYCLES) {
+            ui16_adc_throttle_max = ui16_adc_throttle_max_candidate;
+            ui8_throttle_max_learn_counter = 0;
+        }
+    } else {
+        ui8_throttle_max_learn_counter = 0;
+    }
+
+    // released throttle noise and drift stay under the rest margin over the learned minimum
+    uint16_t ui16_adc_throttle_rest = ui16_adc_throttle_min + ADC_10_BIT_THROTTLE_REST_MARGIN;
+
+    // map value from 0 to 1024, no throttle if out of range (fault)
+    if ((ui16_adc_throttle_value <= ui16_adc_throttle_rest) || (ui16_adc_throttle_value >= ADC_10_BIT_THROTTLE_MAX_VALUE_LIMIT) ||
+        (ui16_adc_throttle_max <= ui16_adc_throttle_rest)) {
+        ui16_throttle = 0;
+    } else if (ui16_adc_throttle_value >= ui16_adc_throttle_max) {
+        ui16_throttle = 1024;
+    } else {
+        ui16_throttle = (uint16_t) (((uint32_t) (ui16_adc_throttle_value - ui16_adc_throttle_rest) << 10) /
+                (uint16_t) (ui16_adc_throttle_max - ui16_adc_throttle_rest));
+    }
+
+    // deadband
+    if (ui16_throttle <= ui16_throttle_deadband) {
+        ui16_throttle = 0;
+    } else {
+        ui16_throttle = (uint16_t) (((uint32_t) (ui16_throttle - ui16_throttle_deadband) << 10) / (uint16_t) (1024 - ui16_throttle_deadband));
+    }
+
+    // response curve, the uploaded assist curve if in use
+    ui8_i = (uint8_t) (ui16_throttle >> 7);
+    if (m_assist_curves[ASSIST_CURVE_THROTTLE].ui8_nr_points >= ASSIST_CURVE_NR_POINTS_MIN) {
+        ui16_throttle = curve_evaluate(&m_assist_curves[ASSIST_CURVE_THROTTLE], ui16_throttle);
+        if (ui16_throttle > 1024) { ui16_throttle = 1024; }
+    } else if (ui8_i >= (THROTTLE_CURVE_NR_POINTS - 1)) {
+        ui16_throttle = ui16_throttle_curve[THROTTLE_CURVE_NR_POINTS - 1];
+    } else {
+        ui16_throttle = (uint16_t) ((int16_t) ui16_throttle_curve[ui8_i] +
+                (int16_t) (((int32_t) ((int16_t) ui16_throttle_curve[ui8_i + 1] - (int16_t) ui16_throttle_curve[ui8_i]) * (ui16_throttle & 127)) >> 7));
+    }
+
+    // throttle value from 0 to 255
+    ui8_adc_throttle = (ui16_throttle > 1020) ? 255 : (uint8_t) (ui16_throttle >> 2);
+
+    // map throttle value from 0 to max battery current
+    ui16_adc_battery_current_target_x256 = (uint16_t) (((uint32_t) ui16_throttle * ui8_adc_battery_current_max) >> 2);
+
+    // limit current rise rate, decrease is immediate
+    if ((ui16_throttle_current_rate_x256) && (ui16_adc_battery_current_target_x256 > ui16_throttle_current_target_x256) &&
+        ((ui16_adc_battery_current_target_x256 - ui16_throttle_current_target_x256) > ui16_throttle_current_rate_x256)) {
+        ui16_throttle_current_target_x256 += ui16_throttle_current_rate_x256;
+    } else {
+        ui16_throttle_current_target_x256 = ui16_adc_battery_current_target_x256;
+    }
+
+    uint8_t ui8_adc_battery_current_target_throttle = (uint8_t) (ui16_throttle_current_target_x256 >> 8);
+
+    if (ui8_adc_battery_current_target_throttle > ui8_adc_battery_current_target) {
+        // set motor acceleration, current rise rate is limited by the throttle if configured
+        if (ui16_throttle_current_rate_x256) {
+            ui8_duty_cycle_ramp_up_inverse_step = PWM_DUTY_CYCLE_RAMP_UP_INVERSE_STEP_MIN;
+            ui8_duty_cycle_ramp_down_inverse_step = PWM_DUTY_CYCLE_RAMP_DOWN_INVERSE_STEP_MIN;
+        } else {
+            // wheel speed bins of the motor acceleration tables, without cadence
+            uint8_t ui8_speed_bin = get_ramp_speed_bin();
+            
+            ui8_duty_cycle_ramp_up_inverse_step = ui8_ramp_up_throttle_table[ui8_speed_bin];
+            ui8_duty_cycle_ramp_down_inverse_step = ui8_ramp_down_table[ui8_speed_bin][0];
+        }
+        // set battery current target
+        ui8_adc_battery_current_target = ui8_adc_battery_current_target_throttle;
+
+        // set duty cycle target
+        ui8_duty_cycle_target = PWM_DUTY_CYCLE_MAX;
+    }
+}
+
+
+
+static void apply_temperature_limiting()
+{
+  
+  // get ADC measurement
+  volatile uint16_t ui16_temp = ui16_adc_throttle_filtered;
+  
+  // filter ADC measurement to motor temperature variable
+  ui16_adc_motor_temperature_filtered = filter(ui16_temp, ui16_adc_motor_temperature_filtered, 8);
+  
+    // convert ADC value
+  ui8_motor_temperature_filtered = ui8_sat_u16((ui16_adc_motor_temperature_filtered * 39U) / 80U);
+
+    // min temperature value can not be equal or higher than max temperature value
+  if (ui8_motor_temperature_min_value_to_limit >= ui8_motor_temperature_max_value_to_limit) {
+        ui8_adc_battery_current_target = 0;
+    } else {
+        // adjust target current if motor over temperature limit
+        ui8_adc_battery_current_target = map_ui8(ui8_motor_temperature_filtered,
+                ui8_motor_temperature_min_value_to_limit,
+                ui8_motor_temperature_max_value_to_limit,
+                ui8_adc_battery_current_target,
+                0);
+    }
+}
+
+
+
+static uint8_t get_thermal_node_current_limit(struct_thermal_node *p_node, uint8_t ui8_adc_current)
+{
+  // use the predicted temperature, or the actual one if higher when cooling down
+  uint8_t ui8_temperature = ui8_max(p_node->ui8_temperature, p_node->ui8_temperature_predicted);
+
+  // reduce current linearly down to zero at max temperature
+  return map_ui8(ui8_temperature,
+          (uint8_t)(p_node->ui8_temperature_max - THERMAL_MODEL_DERATING_RANGE),
+          p_node->ui8_temperature_max,
+          ui8_adc_current,
+          0);
+}
+
+
+
+static void apply_thermal_derating()
+{
+  ui8_adc_battery_current_target = get_thermal_node_current_limit(&m_thermal_winding, ui8_adc_battery_current_target);
+  ui8_adc_battery_current_target = get_thermal_node_current_limit(&m_thermal_mosfets, ui8_adc_battery_current_target);
+}
+
+
+
+static void calc_thermal_model(void)
+{
+  static uint8_t  ui8_counter;
+  static uint32_t ui32_phase_current_squared_accumulated;
+  static uint16_t ui16_phase_current_accumulated;
+  static uint16_t ui16_motor_speed_erps_accumulated;
+
+  // estimate motor phase current from battery current and duty cycle, limit divisor at low duty cycle
+  uint8_t ui8_duty_cycle = ui8_max(ui8_g_duty_cycle, PWM_DUTY_CYCLE_STARTUP);
+  uint16_t ui16_adc_phase_current = ((uint16_t) ui8_adc_battery_current_filtered * PWM_DUTY_CYCLE_MAX) / ui8_duty_cycle;
+  if (ui16_adc_phase_current > 255) { ui16_adc_phase_current = 255; }
+
+  ui32_phase_current_squared_accumulated += ui16_adc_phase_current * ui16_adc_phase_current;
+  ui16_phase_current_accumulated += ui16_adc_phase_current;
+  ui16_motor_speed_erps_accumulated += ui16_motor_speed_erps;
+
+  if (++ui8_counter < THERMAL_MODEL_UPDATE_CYCLES) { return; }
+
+  // average values of the last second
+  uint16_t ui16_phase_current_squared = ui32_phase_current_squared_accumulated / THERMAL_MODEL_UPDATE_CYCLES;
+  uint8_t  ui8_phase_current = ui16_phase_current_accumulated / THERMAL_MODEL_UPDATE_CYCLES;
+  uint16_t ui16_motor_speed_erps_average = ui16_motor_speed_erps_accumulated / THERMAL_MODEL_UPDATE_CYCLES;
+
+  ui8_counter = 0;
+  ui32_phase_current_squared_accumulated = 0;
+  ui16_phase_current_accumulated = 0;
+  ui16_motor_speed_erps_accumulated = 0;
+
+  // winding copper losses and iron losses in mW
+  uint8_t ui8_winding_resistance = (m_configuration_variables.ui8_motor_type == 0) ?
+      WINDING_RESISTANCE_MILLIOHM_48V_MOTOR : WINDING_RESISTANCE_MILLIOHM_36V_MOTOR;
+
+  uint32_t ui32_winding_losses_mW = (((uint32_t) ui16_phase_current_squared * ui8_winding_resistance) / 39U) +
+      ((uint32_t) ui16_motor_speed_erps_average * WINDING_IRON_LOSSES_MW_PER_ERPS);
+
+  // MOSFETs conduction and switching losses in mW
+  uint32_t ui32_mosfets_losses_mW = (((uint32_t) ui16_phase_current_squared * MOSFETS_RESISTANCE_MILLIOHM) / 39U) +
+      ((uint16_t) ui8_phase_current * MOSFETS_SWITCHING_LOSSES_MW_PER_ADC_STEP);
+
+  update_thermal_node(&m_thermal_winding, ui32_winding_losses_mW);
+  update_thermal_node(&m_thermal_mosfets, ui32_mosfets_losses_mW);
+}
+
+
+
+static uint8_t get_thermal_node_temperature(uint32_t ui32_temperature_rise_x1000000)
+{
+  uint16_t ui16_temperature = ui8_thermal_ambient_temperature + (uint16_t)(ui32_temperature_rise_x1000000 / 1000000U);
+
+  if (ui16_temperature > 255) { return 255; }
+  return (uint8_t) ui16_temperature;
+}
+
+
+
+static void update_thermal_node(struct_thermal_node *p_node, uint32_t ui32_power_losses_mW)
+{
+  uint32_t ui32_temperature_rise_target;
+  uint32_t ui32_temperature_rise_predicted;
+
+  // steady state temperature rise for the actual losses: mW * K/W x1000 = K x1000000
+  if (ui32_power_losses_mW > (THERMAL_MODEL_TEMPERATURE_RISE_MAX / p_node->ui16_thermal_resistance_x1000)) {
+    ui32_temperature_rise_target = THERMAL_MODEL_TEMPERATURE_RISE_MAX;
+  } else {
+    ui32_temperature_rise_target = ui32_power_losses_mW * p_node->ui16_thermal_resistance_x1000;
+  }
+
+  // first order step of one second
+  int32_t i32_temperature_rise_step = ((int32_t) ui32_temperature_rise_target - (int32_t) p_node->ui32_temperature_rise_x1000000) /
+      (int32_t) p_node->ui16_time_constant;
+
+  p_node->ui32_temperature_rise_x1000000 += i32_temperature_rise_step;
+
+  // linear prediction never goes over the steady state temperature as prediction time is lower than time constant
+  if (p_node->ui16_time_constant <= THERMAL_MODEL_PREDICTION_TIME) {
+    ui32_temperature_rise_predicted = ui32_temperature_rise_target;
+  } else {
+    ui32_temperature_rise_predicted = p_node->ui32_temperature_rise_x1000000 + (i32_temperature_rise_step * THERMAL_MODEL_PREDICTION_TIME);
+  }
+
+  p_node->ui8_temperature = get_thermal_node_temperature(p_node->ui32_temperature_rise_x1000000);
+  p_node->ui8_temperature_predicted = get_thermal_node_temperature(ui32_temperature_rise_predicted);
+}
+
+
+
+static void apply_speed_limit()
+{
+    static uint16_t ui16_integral_x256;
+    uint8_t ui8_adc_battery_current_target_no_limit = ui8_adc_battery_current_target;
+
+    if (m_configuration_variables.ui8_wheel_speed_max > 0) {
+        // speed error on the fused speed, updated every cycle also between wheel magnet pulses
+        int16_t i16_error = (int16_t) ((uint16_t) m_configuration_variables.ui8_wheel_speed_max * 10U) - (int16_t) ui16_wheel_speed_x10;
+        int32_t i32_ceiling_x256;
+
+        if (i16_error > SPEED_LIMIT_PI_ERROR_FULL_ASSIST_X10) {
+            // far under the limit, full assist and bumpless start from the current target
+            ui16_integral_x256 = (uint16_t) ui8_adc_battery_current_target << 8;
+            ui8_speed_limit_active = 0;
+            return;
+        }
+
+        /*------------------------------------------------------------------------
+
+          NOTE: regarding the speed limit regulator
+
+          A PI on the speed error sets a battery current ceiling, the
+          integral is the current needed to hold the limit and the
+          proportional term gives full assist under the limit and a
+          fast cut over it. The integral is never over the current
+          target, so there is no windup when the assist is lower
+          than the ceiling.
+
+        ------------------------------------------------------------------------*/
+
+        i32_ceiling_x256 = (int32_t) ui16_integral_x256 + ((int32_t) SPEED_LIMIT_PI_KI_X256 * i16_error);
+        if (i32_ceiling_x256 < 0) { i32_ceiling_x256 = 0; }
+        else if (i32_ceiling_x256 > ((int32_t) ui8_adc_battery_current_target << 8)) { i32_ceiling_x256 = (int32_t) ui8_adc_battery_current_target << 8; }
+        ui16_integral_x256 = (uint16_t) i32_ceiling_x256;
+
+        i32_ceiling_x256 += (int32_t) SPEED_LIMIT_PI_KP_X256 * i16_error;
+        if (i32_ceiling_x256 < 0) { i32_ceiling_x256 = 0; }
+
+        // limit the battery current target to the ceiling
+        if (i32_ceiling_x256 < ((int32_t) ui8_adc_battery_current_target << 8)) {
+            ui8_adc_battery_current_target = (uint8_t) (i32_ceiling_x256 >> 8);
+        }
+    } else {
+        ui16_integral_x256 = (uint16_t) ui8_adc_battery_current_target << 8;
+    }
+
+    ui8_speed_limit_active = (ui8_adc_battery_current_target < ui8_adc_battery_current_target_no_limit);
+}
+
+
+
+static void calc_wheel_speed(void)
+{ 
+  uint32_t ui32_edge_time;
+  uint32_t ui32_edge_interval;
+  uint32_t ui32_time_now;
+  uint32_t ui32_time_from_edge;
+  uint16_t ui16_time_now;
+  uint8_t ui8_edges_valid;
+  static uint32_t ui32_edge_time_old;
+  
+  // get the wheel speed sensor transitions and the time now, extended with the TIM3 overflows
+  disableInterrupts();
+  ui32_edge_time = ui32_wheel_speed_sensor_edge_time;
+  ui32_edge_interval = ui32_wheel_speed_sensor_edge_interval;
+  ui8_edges_valid = ui8_wheel_speed_sensor_edges_valid;
+  ui16_time_now = (uint16_t)TIM3->CNTRH << 8;
+  ui16_time_now |= TIM3->CNTRL;
+  ui32_time_now = ((uint32_t) ui16_tim3_overflow_counter << 16) | ui16_time_now;
+  if ((TIM3->SR1 & TIM3_SR1_UIF) && !(ui16_time_now & 0x8000)) { ui32_time_now += 0x10000; }
+  enableInterrupts();
+  
+  ui32_time_from_edge = ui32_time_now - ui32_edge_time;
+  
+  // new transition with a valid period since last calculation
+  ui8_wheel_speed_sensor_edge_new = (ui32_edge_time != ui32_edge_time_old) && (ui8_edges_valid > 1);
+  ui32_edge_time_old = ui32_edge_time;
+  
+  // calc wheel speed in km/h x10
+  if ((ui8_edges_valid > 1) && (ui32_time_from_edge < WHEEL_SPEED_SENSOR_STOP_TIMEOUT))
+  {
+    // speed can't be higher than the one given by the time from last transition
+    if (ui32_time_from_edge > ui32_edge_interval) { ui32_edge_interval = ui32_time_from_edge; }
+    
+    ui16_wheel_speed_sensor_x10 = (uint16_t) (ui32_wheel_speed_sensor_x10_times_ticks / ui32_edge_interval);
+  }
+  else
+  {
+    ui16_wheel_speed_sensor_x10 = 0;
+  }
+  
+  // wheel stop: the next transition is only the reference
+  if ((ui8_edges_valid) && ((ui32_time_from_edge >= WHEEL_SPEED_SENSOR_STOP_TIMEOUT) ||
+      ((ui8_edges_valid > 1) && (ui16_wheel_speed_sensor_x10 < WHEEL_SPEED_SENSOR_SPEED_MIN_X10))))
+  {
+    ui16_wheel_speed_sensor_x10 = 0;
+    
+    disableInterrupts();
+    if (ui32_wheel_speed_sensor_edge_time == ui32_edge_time) { ui8_wheel_speed_sensor_edges_valid = 0; }
+    enableInterrupts();
+  }
+  
+      /*-------------------------------------------------------------------------------------------------
+      
+        NOTE: regarding the wheel speed calculation
+        Every wheel speed sensor transition is timestamped with TIM3 (4us) in the sensor interrupt.
+        Between transitions the time from the last one is used when it is longer than the last
+        period, so the speed decays and reaches 0 after a stop without waiting for a timeout.
+        
+        Formula for calculating the wheel speed in km/h x10:
+        (1) Wheel speed in km/h x10 = (wheel perimeter mm * 36 * HALL_COUNTER_FREQ / 1000) / (magnets * ticks)
+		(2) Wheel speed in km/h x10 = wheel perimeter mm * 9000 / (magnets * ticks)
+		
+		The dividend (wheel perimeter mm * 9000 / magnets) is only calculated when configured.
+        
+      -------------------------------------------------------------------------------------------------*/
+}
+
+
+static void calc_gear_shift(void)
+{
+  static uint16_t ui16_pedal_cadence_filtered_x16;
+  static uint32_t ui32_wheel_speed_sensor_edge_time_old;
+  static uint32_t ui32_ratio_erps_accumulated;
+  static uint16_t ui16_ratio_cycles;
+  static uint32_t ui32_ratio_reference;
+  static uint8_t  ui8_ratio_period_valid;
+  static uint8_t  ui8_ratio_hold;
+  uint32_t ui32_edge_time;
+  uint32_t ui32_edge_interval;
+  uint16_t ui16_erps = ui16_motor_speed_erps;
+  uint16_t ui16_wheel_speed = ui16_wheel_speed_sensor_x10;
+  uint16_t ui16_cadence = ui16_pedal_cadence_RPM_x10;
+  uint8_t  ui8_shift_detected = 0;
+  
+  // wheel speed sensor transitions, timestamped in the sensor interrupt
+  disableInterrupts();
+  ui32_edge_time = ui32_wheel_speed_sensor_edge_time;
+  ui32_edge_interval = ui32_wheel_speed_sensor_edge_interval;
+  enableInterrupts();
+  
+  // hold and ramp back the current after a shift
+  if (ui8_gear_shift_hold_counter) {
+    ui8_gear_shift_hold_counter--;
+  } else if (ui16_gear_shift_current_factor_x256 < 256) {
+    ui16_gear_shift_current_factor_x256 += ui8_gear_shift_ramp_step_x256;
+    if (ui16_gear_shift_current_factor_x256 > 256) { ui16_gear_shift_current_factor_x256 = 256; }
+  }
+  
+  // detect only with the motor driving the wheel and the rider pedaling
+  if ((ui8_gear_shift_detection_enabled) &&
+      (ui8_controller_adc_battery_current_target) &&
+      (ui16_erps >= GEAR_SHIFT_ERPS_MIN) &&
+      (ui16_wheel_speed >= GEAR_SHIFT_WHEEL_SPEED_MIN_X10) &&
+      (ui16_cadence >= GEAR_SHIFT_CADENCE_MIN_X10) &&
+      (ui16_pedal_cadence_filtered_x16 >= (GEAR_SHIFT_CADENCE_MIN_X10 << 4))) {
+    
+    // motor speed to wheel speed ratio, once every wheel speed sensor period with the motor speed averaged over the same period
+    ui32_ratio_erps_accumulated += ui16_erps;
+    ui16_ratio_cycles++;
+    
+    if (ui32_edge_time != ui32_wheel_speed_sensor_edge_time_old) {
+      // the first period is not complete
+      if ((ui8_ratio_period_valid) && (ui16_ratio_cycles >= GEAR_SHIFT_RATIO_CYCLES_MIN)) {
+        uint32_t ui32_ratio = (ui32_ratio_erps_accumulated / ui16_ratio_cycles) * ui32_edge_interval;
+        uint32_t ui32_ratio_delta = (ui32_ratio > ui32_ratio_reference) ? (ui32_ratio - ui32_ratio_reference) : (ui32_ratio_reference - ui32_ratio);
+        
+        if (!ui32_ratio_reference) {
+          ui32_ratio_reference = ui32_ratio;
+        } else if (ui32_ratio_delta > (ui32_ratio_reference >> GEAR_SHIFT_RATIO_JUMP_SHIFT)) {
+          // new gear
+          ui8_shift_detected = 1;
+          ui8_ratio_hold = 0;
+          ui32_ratio_reference = ui32_ratio;
+        } else if ((ui32_ratio_delta > (ui32_ratio_reference >> GEAR_SHIFT_RATIO_HOLD_SHIFT)) && (!ui8_ratio_hold)) {
+          // maybe a shift in the middle of the period, keep the reference for the next one
+          ui8_ratio_hold = 1;
+        } else {
+          ui8_ratio_hold = 0;
+          ui32_ratio_reference = ui32_ratio_reference - (ui32_ratio_reference >> GEAR_SHIFT_RATIO_FILTER_SHIFT) + (ui32_ratio >> GEAR_SHIFT_RATIO_FILTER_SHIFT);
+        }
+      }
+      
+      ui8_ratio_period_valid = 1;
+      ui32_ratio_erps_accumulated = 0;
+      ui16_ratio_cycles = 0;
+    }
+    
+    // cadence jump with a pedal torque drop
+    uint16_t ui16_cadence_x16 = ui16_cadence << 4;
+    uint16_t ui16_cadence_delta_x16 = (ui16_cadence_x16 > ui16_pedal_cadence_filtered_x16) ?
+        (ui16_cadence_x16 - ui16_pedal_cadence_filtered_x16) : (ui16_pedal_cadence_filtered_x16 - ui16_cadence_x16);
+    uint16_t ui16_torque_revolution_x4 = (ui16_adc_pedal_torque_revolution_x4 > ui16_adc_pedal_torque_offset_x4) ?
+        (ui16_adc_pedal_torque_revolution_x4 - ui16_adc_pedal_torque_offset_x4) : 0;
+    uint16_t ui16_torque_x4 = (ui16_adc_pedal_torque_x4 > ui16_adc_pedal_torque_offset_x4) ?
+        (ui16_adc_pedal_torque_x4 - ui16_adc_pedal_torque_offset_x4) : 0;
+    
+    if ((ui16_cadence_delta_x16 > (ui16_pedal_cadence_filtered_x16 >> GEAR_SHIFT_CADENCE_JUMP_SHIFT)) &&
+        (ui16_torque_x4 < (ui16_torque_revolution_x4 >> GEAR_SHIFT_TORQUE_DROP_SHIFT))) {
+      ui8_shift_detected = 1;
+    }
+  } else {
+    // start again with a new reference
+    ui8_ratio_period_valid = 0;
+    ui8_ratio_hold = 0;
+    ui32_ratio_reference = 0;
+    ui32_ratio_erps_accumulated = 0;
+    ui16_ratio_cycles = 0;
+  }
+  
+  ui32_wheel_speed_sensor_edge_time_old = ui32_edge_time;
+  
+  // cut the current at once in the motor controller, not waiting for the next 25ms cycle
+  if ((ui8_shift_detected) && (ui16_gear_shift_current_factor_x256 == 256)) {
+    ui8_gear_shift_counter++;
+    ui16_gear_shift_current_factor_x256 = ui8_gear_shift_current_x256;
+    ui8_gear_shift_hold_counter = ui8_gear_shift_hold_cycles;
+    ui8_controller_adc_battery_current_target = (uint8_t) (((uint16_t) ui8_controller_adc_battery_current_target * ui8_gear_shift_current_x256) >> 8);
+  }
+  
+  // reference for the cadence jump
+  ui16_pedal_cadence_filtered_x16 = ui16_pedal_cadence_filtered_x16 - (ui16_pedal_cadence_filtered_x16 >> GEAR_SHIFT_FILTER_SHIFT) +
+      ((ui16_cadence << 4) >> GEAR_SHIFT_FILTER_SHIFT);
+}
+
+
+static void apply_gear_shift_current_reduction(void)
+{
+  if (ui16_gear_shift_current_factor_x256 < 256) {
+    ui8_adc_battery_current_target = (uint8_t) (((uint16_t) ui8_adc_battery_current_target * ui16_gear_shift_current_factor_x256) >> 8);
+  }
+}
+
+
+static void calc_speed_fusion(void)
+{
+  uint16_t ui16_motor_speed_x10;
+  uint16_t ui16_ratio_x256 = 0;
+  uint16_t ui16_motor_speed_erps_tmp = ui16_motor_speed_erps;
+  
+  // the motor is coupled to the rear wheel only when it is driving
+  uint8_t ui8_motor_coupled = (ui16_motor_speed_erps_tmp >= SPEED_FUSION_ERPS_MIN) &&
+      (ui8_battery_current_filtered_x10 >= SPEED_FUSION_CURRENT_MIN_X10);
+  
+  // wheel speed from motor speed and learned drivetrain ratio
+  ui16_motor_speed_x10 = (uint16_t) (((uint32_t) ui16_motor_speed_erps_tmp * ui16_wheel_speed_motor_ratio_x256) >> 8);
+  
+  if (ui8_motor_coupled)
+  {
+    // measured ratio, only for full periods of the wheel speed sensor
+    if (ui8_wheel_speed_sensor_edge_new)
+    {
+      ui16_ratio_x256 = (uint16_t) (((uint32_t) ui16_wheel_speed_sensor_x10 << 8) / ui16_motor_speed_erps_tmp);
+    }
+    
+    if ((ui16_wheel_speed_sensor_x10 > (((uint32_t) ui16_motor_speed_erps_tmp * SPEED_FUSION_RATIO_MAX_X256) >> 8)) ||
+        ((!ui16_wheel_speed_sensor_x10) &&
+         ((((uint32_t) ui16_motor_speed_erps_tmp * SPEED_FUSION_RATIO_MIN_X256) >> 8) > (WHEEL_SPEED_SENSOR_SPEED_MIN_X10 * 2))))
+    {
+      // no transitions while the motor drives the wheel for sure or implausible speed
+      if (ui16_wheel_speed_sensor_fault_counter < SPEED_SENSOR_FAULT_COUNTER_THRESHOLD) { ui16_wheel_speed_sensor_fault_counter++; }
+      else { ui8_wheel_speed_sensor_fault = 1; }
+    }
+    else if ((ui16_ratio_x256 >= SPEED_FUSION_RATIO_MIN_X256) && (ui16_ratio_x256 <= SPEED_FUSION_RATIO_MAX_X256))
+    {
+      // plausible period, learn the ratio, it follows the gear changes
+      ui16_wheel_speed_sensor_fault_counter = 0;
+      ui8_wheel_speed_sensor_fault = 0;
+      
+      if (ui8_wheel_speed_motor_ratio_learned)
+      {
+        ui16_wheel_speed_motor_ratio_x256 = (uint16_t) (((uint32_t) ui16_wheel_speed_motor_ratio_x256 * ((1 << SPEED_FUSION_RATIO_FILTER) - 1) + ui16_ratio_x256) >> SPEED_FUSION_RATIO_FILTER);
+      }
+      else
+      {
+        ui16_wheel_speed_motor_ratio_x256 = ui16_ratio_x256;
+        ui8_wheel_speed_motor_ratio_learned = 1;
+      }
+    }
+  }
+  
+  if (ui8_wheel_speed_sensor_fault)
+  {
+    // wheel speed from motor only, it is the lowest possible speed when the motor is not driving
+    ui16_wheel_speed_x10 = ui16_motor_speed_x10;
+  }
+  else if ((ui8_motor_coupled) && (ui8_wheel_speed_motor_ratio_learned) &&
+      (ui16_motor_speed_x10 > (ui16_wheel_speed_sensor_x10 - (ui16_wheel_speed_sensor_x10 >> SPEED_FUSION_TOLERANCE_SHIFT))) &&
+      (ui16_motor_speed_x10 < (ui16_wheel_speed_sensor_x10 + (ui16_wheel_speed_sensor_x10 >> SPEED_FUSION_TOLERANCE_SHIFT))))
+  {
+    // motor speed changes at every Hall sensor transition, use it between wheel speed sensor transitions
+    ui16_wheel_speed_x10 = ui16_motor_speed_x10;
+  }
+  else
+  {
+    // not coupled or the ratio is changing (gear shift)
+    ui16_wheel_speed_x10 = ui16_wheel_speed_sensor_x10;
+  }
+  
+      /*-------------------------------------------------------------------------------------------------
+      
+        NOTE: regarding the speed fusion
+        When the motor drives the rear wheel, the wheel speed is the motor ERPS times the drivetrain
+        ratio of the selected gear. The ratio is learned at every wheel speed sensor transition and
+        the motor speed is used between transitions when within 25% of the wheel speed sensor.
+        
+        If the motor drives for 5 seconds at a speed that must turn the wheel at least at 4 km/h
+        (lowest gear) and there are no wheel speed sensor transitions, or if the wheel speed is
+        too high for the motor speed, the wheel speed sensor is faulty. The speed is then from the
+        motor only with the last learned ratio, so the speed limit keeps working, and the error
+        is sent to the display without stopping the motor.
+        
+      -------------------------------------------------------------------------------------------------*/
+}
+
+
+
+static void calc_cadence(void) {
+    uint16_t ui16_edge_interval[CADENCE_SENSOR_EDGES_BUFFER_SIZE];
+    uint16_t ui16_edge_time;
+    uint16_t ui16_time_now;
+    uint16_t ui16_time_from_edge;
+    uint16_t ui16_stop_timeout;
+    uint32_t ui32_edges_time = 0;
+    uint8_t ui8_edge_index;
+    uint8_t ui8_edges_valid;
+    uint8_t ui8_edges;
+    uint8_t ui8_i;
+
+    // get the cadence sensor transitions
+    disableInterrupts();
+    for (ui8_i = 0; ui8_i < CADENCE_SENSOR_EDGES_BUFFER_SIZE; ui8_i++) {
+        ui16_edge_interval[ui8_i] = ui16_cadence_sensor_edge_interval[ui8_i];
+    }
+    ui8_edge_index = ui8_cadence_sensor_edge_index;
+    ui8_edges_valid = ui8_cadence_sensor_edges_valid;
+    ui16_edge_time = ui16_cadence_sensor_edge_time;
+    ui16_time_now = (uint16_t)TIM3->CNTRH << 8;
+    ui16_time_now |= TIM3->CNTRL;
+    enableInterrupts();
+
+    // time from last transition, TIM3 wraps after 262ms so also count the cycles without transitions
+    if (ui16_edge_time != ui16_cadence_sensor_edge_time_old) {
+        ui16_cadence_sensor_edge_time_old = ui16_edge_time;
+        ui8_cadence_sensor_edge_cycles = 0;
+    } else if (ui8_cadence_sensor_edge_cycles < 10) {
+        ui8_cadence_sensor_edge_cycles++;
+    }
+    ui16_time_from_edge = (ui8_cadence_sensor_edge_cycles < 10) ? (uint16_t)(ui16_time_now - ui16_edge_time) : 0xffff;
+
+    // adjust pedal stop timeout depending on wheel speed
+    uint8_t ui8_temp = map_ui8((uint8_t)(ui16_wheel_speed_x10 >> 2),
+            10 /* 40 >> 2 */,
+            100 /* 400 >> 2 */,
+            (CADENCE_SENSOR_STOP_TIMEOUT_MAX >> 8),
+            (CADENCE_SENSOR_STOP_TIMEOUT_MIN_AT_SPEED >> 8));
+    ui16_stop_timeout = (uint16_t)ui8_temp << 8;
+
+    // the first transition after a stop is only the reference, then use windows of 1, 2, 4 or 8 transitions
+    ui8_edges = (ui8_edges_valid > 1) ? (ui8_edges_valid - 1) : 0;
+    if (ui8_edges >= 8) { ui8_edges = 8; }
+    else if (ui8_edges >= 4) { ui8_edges = 4; }
+    else if (ui8_edges == 3) { ui8_edges = 2; }
+
+    for (ui8_i = 0; ui8_i < ui8_edges; ui8_i++) {
+        ui32_edges_time += ui16_edge_interval[(ui8_edge_index - ui8_i) & (CADENCE_SENSOR_EDGES_BUFFER_SIZE - 1)];
+    }
+
+    // pedal stop: no transitions for the timeout or for more than 4 times the last transitions period
+    if ((ui16_time_from_edge > ui16_stop_timeout) ||
+        ((ui8_edges) && (((uint32_t) ui16_time_from_edge * ui8_edges) > (ui32_edges_time << 2)))) {
+        ui8_cadence_sensor_edges_valid = 0;
+        ui8_edges = 0;
+    }
+
+    // calculate cadence in RPM x10 and avoid zero division
+    if ((ui8_edges) && (ui32_edges_time)) {
+        // cadence can't be higher than the one given by the time from last transition
+        if (((uint32_t) ui16_time_from_edge * ui8_edges) > ui32_edges_time) {
+            ui32_edges_time = (uint32_t) ui16_time_from_edge * ui8_edges;
+        }
+        ui16_pedal_cadence_RPM_x10 = (uint16_t) ((CADENCE_SENSOR_RPM_X10_TIMES_TICKS * ui8_edges) / ui32_edges_time);
+    } else {
+        ui16_pedal_cadence_RPM_x10 = 0;
+    }
+
+    // cadence in RPM, never 0 when pedaling
+    ui8_pedal_cadence_RPM = (ui16_pedal_cadence_RPM_x10 > 2550) ? 255 : (uint8_t) (ui16_pedal_cadence_RPM_x10 / 10U);
+    if ((ui16_pedal_cadence_RPM_x10) && (ui8_pedal_cadence_RPM == 0)) { ui8_pedal_cadence_RPM = 1; }
+
+      /*-------------------------------------------------------------------------------------------------
+      
+        NOTE: regarding the cadence calculation
+        Cadence is calculated from the time of the last 1, 2, 4 or 8 transitions of both PAS sensors,
+        measured with TIM3 (4us). Only windows of 4 or 8 transitions give the exact cadence, the
+        shorter ones are used for a fast start.
+        
+        Formula for calculating the cadence in RPM x10:
+        (1) Cadence in RPM x10 = (60 * 10 * HALL_COUNTER_FREQ) / (CADENCE_SENSOR_NUMBER_MAGNETS * 4) * transitions / ticks
+		(2) Cadence in RPM x10 = 1875000 * transitions / ticks
+        
+      -------------------------------------------------------------------------------------------------*/
+}
+
+
+
+
+static void get_battery_voltage_filtered(void)
+{
+  uint16_t ui16_adc_battery_voltage = ui16_adc_battery_voltage_filtered;
+  
+  ui16_battery_voltage_filtered_x1000 = ui16_adc_battery_voltage * BATTERY_VOLTAGE_PER_10_BIT_ADC_STEP_X1000;
+  
+  // battery voltage reciprocal, the only division by the voltage each cycle
+  if (ui16_adc_battery_voltage < BATTERY_VOLTAGE_RECIPROCAL_ADC_MIN) { ui16_adc_battery_voltage = BATTERY_VOLTAGE_RECIPROCAL_ADC_MIN; }
+  ui16_adc_battery_current_per_power_x100_q22 = (uint16_t) (BATTERY_CURRENT_PER_POWER_X100_Q22_TIMES_ADC_VOLTAGE / ui16_adc_battery_voltage);
+}
+
+
+
+
+static void get_battery_current_filtered(void)
+{
+  ui8_battery_current_filtered_x10 = ui8_sat_u16(((uint16_t) ui8_adc_battery_current_filtered * BATTERY_CURRENT_PER_10_BIT_ADC_STEP_X100) / 10U);
+}
+
+
+
+static int16_t get_battery_estimator_deviation(int32_t i32_deviation)
+{
+  if (i32_deviation > BATTERY_ESTIMATOR_DEVIATION_MAX) { return BATTERY_ESTIMATOR_DEVIATION_MAX; }
+  if (i32_deviation < -BATTERY_ESTIMATOR_DEVIATION_MAX) { return -BATTERY_ESTIMATOR_DEVIATION_MAX; }
+  return (int16_t) i32_deviation;
+}
+
+
+
+static void calc_battery_resistance(void)
+{
+  static uint8_t  ui8_initialized;
+  static uint16_t ui16_voltage_mean_x64;
+  static uint16_t ui16_current_mean_x64;
+  static int32_t  i32_covariance;
+  static int32_t  i32_current_variance;
+
+  uint16_t ui16_voltage_x64 = ui16_adc_battery_voltage_filtered << 6;
+  uint16_t ui16_current_x64 = (uint16_t) ui8_adc_battery_current_filtered << 6;
+
+  // wait for the first voltage measurement
+  if (!ui16_voltage_x64) { return; }
+
+  if (!ui8_initialized) {
+    ui8_initialized = 1;
+    ui16_voltage_mean_x64 = ui16_voltage_x64;
+    ui16_current_mean_x64 = ui16_current_x64;
+  }
+
+  // exponentially weighted mean values
+  ui16_voltage_mean_x64 += ((int32_t) ui16_voltage_x64 - ui16_voltage_mean_x64) >> BATTERY_ESTIMATOR_FILTER_COEFFICIENT;
+  ui16_current_mean_x64 += ((int32_t) ui16_current_x64 - ui16_current_mean_x64) >> BATTERY_ESTIMATOR_FILTER_COEFFICIENT;
+
+  int16_t i16_voltage_deviation = get_battery_estimator_deviation((int32_t) ui16_voltage_x64 - ui16_voltage_mean_x64);
+  int16_t i16_current_deviation = get_battery_estimator_deviation((int32_t) ui16_current_x64 - ui16_current_mean_x64);
+
+  // exponentially weighted covariance of voltage and current, and variance of current
+  i32_covariance += (((int32_t) i16_current_deviation * i16_voltage_deviation) - i32_covariance) >> BATTERY_ESTIMATOR_FILTER_COEFFICIENT;
+  i32_current_variance += (((int32_t) i16_current_deviation * i16_current_deviation) - i32_current_variance) >> BATTERY_ESTIMATOR_FILTER_COEFFICIENT;
+
+  // fit the voltage sag only when current changed enough, voltage must drop when current increases
+  if ((i32_current_variance > BATTERY_ESTIMATOR_CURRENT_VARIANCE_MIN) && (i32_covariance < 0)) {
+    // R = -covariance / variance
+    int32_t i32_resistance_x4096 = (-i32_covariance << 4) / (i32_current_variance >> 8);
+
+    if (i32_resistance_x4096 > BATTERY_RESISTANCE_X4096_MAX) { i32_resistance_x4096 = BATTERY_RESISTANCE_X4096_MAX; }
+
+    ui16_battery_resistance_x4096 += (i32_resistance_x4096 - ui16_battery_resistance_x4096) >> BATTERY_RESISTANCE_FILTER_COEFFICIENT;
+  }
+
+  if (ui16_battery_resistance_x4096 < BATTERY_RESISTANCE_X4096_MIN) { ui16_battery_resistance_x4096 = BATTERY_RESISTANCE_X4096_MIN; }
+
+  // open circuit voltage = loaded voltage + R * I
+  uint32_t ui32_open_circuit_voltage_x64 = ui16_voltage_mean_x64 +
+      (((uint32_t) ui16_battery_resistance_x4096 * ui16_current_mean_x64) >> 12);
+
+  if (ui32_open_circuit_voltage_x64 > 0xffff) { ui32_open_circuit_voltage_x64 = 0xffff; }
+  ui16_battery_open_circuit_voltage_x64 = (uint16_t) ui32_open_circuit_voltage_x64;
+}
+
+
+
+static void apply_battery_voltage_limiting()
+{
+  uint32_t ui32_adc_battery_voltage_min_x64 = (uint32_t)(ui16_adc_voltage_cut_off + ui8_adc_battery_voltage_margin) << 6;
+  uint16_t ui16_adc_current_limit = 0;
+
+  // max current that keeps the loaded voltage over the cut off voltage: I = (OCV - V min) / R
+  if (ui16_battery_open_circuit_voltage_x64 > ui32_adc_battery_voltage_min_x64) {
+    ui16_adc_current_limit = ((ui16_battery_open_circuit_voltage_x64 - ui32_adc_battery_voltage_min_x64) << 6) /
+        ui16_battery_resistance_x4096;
+
+    if (ui16_adc_current_limit > 255) { ui16_adc_current_limit = 255; }
+  }
+
+  // smooth the current limit so there are no on/off cut outs
+  if (ui16_adc_current_limit < ui8_adc_battery_current_voltage_limit) {
+    ui8_adc_battery_current_voltage_limit -= (uint8_t)((uint16_t)(ui8_adc_battery_current_voltage_limit - ui16_adc_current_limit + 3) >> BATTERY_CURRENT_LIMIT_FILTER_COEFFICIENT);
+  } else {
+    ui8_adc_battery_current_voltage_limit += (uint8_t)((uint16_t)(ui16_adc_current_limit - ui8_adc_battery_current_voltage_limit) >> BATTERY_CURRENT_LIMIT_FILTER_COEFFICIENT);
+  }
+
+  ui8_adc_battery_current_target = ui8_min(ui8_adc_battery_current_target, ui8_adc_battery_current_voltage_limit);
+}
+
+
+
+static void calc_torque_sensor_linear_weight(void)
+{
+  uint8_t ui8_i;
+  uint16_t ui16_weight;
+
+  // first segment starts at the pedal torque offset, the others at each point ADC value
+  ui16_torque_sensor_linear_offset = ui16_adc_pedal_torque_offset;
+  ui16_torque_sensor_linear_weight[0] = 0;
+  ui16_weight = (uint16_t) ((uint16_t) (ui16_torque_sensor_linear_values[2] - ui16_torque_sensor_linear_offset) * ui16_torque_sensor_linear_values[1]);
+
+  for (ui8_i = 1; ui8_i < ui8_torque_sensor_linear_nr_points; ui8_i++) {
+    ui16_torque_sensor_linear_weight[ui8_i] = ui16_weight;
+
+    // add the full segment from this point to the next one
+    if ((ui8_i + 1) < ui8_torque_sensor_linear_nr_points) {
+      ui16_weight += (uint16_t) ((uint16_t) (ui16_torque_sensor_linear_values[(ui8_i << 1) + 2] - ui16_torque_sensor_linear_values[ui8_i << 1]) *
+          ui16_torque_sensor_linear_values[(ui8_i << 1) + 1]);
+    }
+  }
+
+  ui8_torque_sensor_linear_update = 0;
+}
+
+
+
+static void linearize_torque_sensor_to_kgs(uint16_t *ui16_p_torque_sensor_adc_steps, uint16_t *ui16_torque_sensor_weight_x10)
+{
+  uint8_t ui8_segment;
+  uint16_t ui16_p_torque_sensor_adc_absolute_steps;
+  uint16_t ui16_segment_start;
+  uint16_t ui16_weight;
+
+  if(*ui16_p_torque_sensor_adc_steps > 0){
+
+  // precompute the segments weight only when the points or the torque offset change
+  if ((ui8_torque_sensor_linear_update) || (ui16_torque_sensor_linear_offset != ui16_adc_pedal_torque_offset)) {
+    calc_torque_sensor_linear_weight();
+  }
+
+  ui16_p_torque_sensor_adc_absolute_steps = *ui16_p_torque_sensor_adc_steps + ui16_torque_sensor_linear_offset;
+
+  // find the segment: the last one if the value is over all the points
+  for (ui8_segment = 1; ui8_segment < ui8_torque_sensor_linear_nr_points; ui8_segment++) {
+    if (ui16_p_torque_sensor_adc_absolute_steps < ui16_torque_sensor_linear_values[ui8_segment << 1]) { break; }
+  }
+  ui8_segment--;
+
+  ui16_segment_start = ui8_segment ? ui16_torque_sensor_linear_values[ui8_segment << 1] : ui16_torque_sensor_linear_offset;
+
+  // weight at segment start + steps in the segment * segment slope
+  ui16_weight = ui16_torque_sensor_linear_weight[ui8_segment] +
+      (uint16_t) ((uint16_t) (ui16_p_torque_sensor_adc_absolute_steps - ui16_segment_start) * ui16_torque_sensor_linear_values[(ui8_segment << 1) + 1]);
+
+  // divide by 10: exact for all 16 bit values and faster than a 16 bit division
+  *ui16_torque_sensor_weight_x10 = (uint16_t) (((uint32_t) ui16_weight * 52429U) >> 19);
+  }
+  // no torque_sensor_adc_steps
+  else
+  {
+    *ui16_torque_sensor_weight_x10 = 0;
+  }
+}
+
+
+
+#define TOFFSET_BLOCK_CYCLES 8        // Torque offset calculation averages blocks of 8 cycles = 200ms (25ms*8)
+#define TOFFSET_STABLE_RANGE_X4 4     // Calculation ends when 2 blocks are stable within 1 ADC step, usually after 400ms
+#define TOFFSET_END_CYCLES 200        // Calculation ends anyway after 200 cycles = 5sec (25ms*200)
+#define TOFFSET_TRACKING_CYCLES 40    // Zero tracking averages 40 cycles = 1sec (25ms*40) with pedals stopped
+#define TOFFSET_TRACKING_WINDOW_X4 (ADC_TORQUE_SENSOR_CALIBRATION_OFFSET << 2) // and torque near zero
+#define TOFFSET_TRACKING_NOISE_X4 8   // readings more than 2 ADC steps under the zero are back pressure, not drift
+static uint8_t toffset_cycle_counter = 0;
+static uint8_t ui8_torque_offset_calibrated = 0;
+static uint8_t ui8_toffset_counter = 0;
+static uint32_t ui32_toffset_sum_x4 = 0;
+static uint16_t ui16_toffset_min_x4 = 0xffff;
+static uint16_t ui16_toffset_max_x4 = 0;
+static uint16_t ui16_toffset_block_average_x4 = 0;
+static uint16_t ui16_adc_pedal_torque_zero_x4 = 0;
+
+static void get_adc_pedal_torque_oversampled(void) {
+    uint32_t ui32_adc_torque_sum;
+    uint16_t ui16_adc_torque_count;
+
+    // take the torque samples accumulated by the PWM interrupt since last cycle (about 450 samples)
+    disableInterrupts();
+    ui32_adc_torque_sum = ui32_adc_torque_accumulated;
+    ui16_adc_torque_count = ui16_adc_torque_accumulated_count;
+    enableInterrupts();
+
+    ui32_adc_torque_sum -= ui32_adc_torque_accumulated_old;
+    ui16_adc_torque_count -= ui16_adc_torque_accumulated_count_old;
+    ui32_adc_torque_accumulated_old += ui32_adc_torque_sum;
+    ui16_adc_torque_accumulated_count_old += ui16_adc_torque_count;
+
+    // average with 2 more bits of resolution
+    if (ui16_adc_torque_count) {
+        ui16_adc_pedal_torque_x4 = (uint16_t) ((ui32_adc_torque_sum << 2) / ui16_adc_torque_count);
+    }
+
+    // assist follows the average torque of the last crank revolution
+    if ((ui8_torque_averaging_enabled) && (ui16_pedal_cadence_RPM_x10)) {
+        ui16_adc_pedal_torque_x4 = ui16_adc_pedal_torque_revolution_x4;
+    }
+}
+
+static void calc_pedal_torque_offset(void) {
+    uint16_t ui16_adc_torque_x4 = ui16_adc_pedal_torque_x4;
+
+    if (!ui8_torque_offset_calibrated) {
+        // startup: average blocks of cycles and stop as soon as two consecutive blocks are stable
+        ui32_toffset_sum_x4 += ui16_adc_torque_x4;
+        if (ui16_adc_torque_x4 < ui16_toffset_min_x4) { ui16_toffset_min_x4 = ui16_adc_torque_x4; }
+        if (ui16_adc_torque_x4 > ui16_toffset_max_x4) { ui16_toffset_max_x4 = ui16_adc_torque_x4; }
+        toffset_cycle_counter++;
+
+        if (++ui8_toffset_counter >= TOFFSET_BLOCK_CYCLES) {
+            uint16_t ui16_block_average_x4 = (uint16_t) (ui32_toffset_sum_x4 / TOFFSET_BLOCK_CYCLES);
+            uint16_t ui16_block_change_x4 = (ui16_block_average_x4 > ui16_toffset_block_average_x4) ?
+                (ui16_block_average_x4 - ui16_toffset_block_average_x4) : (ui16_toffset_block_average_x4 - ui16_block_average_x4);
+
+            if ((((ui16_toffset_max_x4 - ui16_toffset_min_x4) <= TOFFSET_STABLE_RANGE_X4) &&
+                 (ui16_block_change_x4 <= TOFFSET_STABLE_RANGE_X4)) ||
+                (toffset_cycle_counter >= TOFFSET_END_CYCLES)) {
+                ui16_adc_pedal_torque_zero_x4 = ui16_block_average_x4;
+                ui8_torque_offset_calibrated = 1;
+            }
+
+            ui16_toffset_block_average_x4 = ui16_block_average_x4;
+            ui8_toffset_counter = 0;
+            ui32_toffset_sum_x4 = 0;
+            ui16_toffset_min_x4 = 0xffff;
+            ui16_toffset_max_x4 = 0;
+        }
+    } else if ((ui16_pedal_cadence_RPM_x10 == 0) && (!ui8_brake_state) && (!ui8_pas_backward) &&
+               (ui16_adc_torque_x4 < (ui16_adc_pedal_torque_zero_x4 + TOFFSET_TRACKING_WINDOW_X4)) &&
+               ((ui16_adc_torque_x4 + TOFFSET_TRACKING_NOISE_X4) > ui16_adc_pedal_torque_zero_x4)) {
+        // pedals stopped, crank unloaded and no brake or back pressure: slowly track the zero drift
+        ui32_toffset_sum_x4 += ui16_adc_torque_x4;
+
+        if (++ui8_toffset_counter >= TOFFSET_TRACKING_CYCLES) {
+            uint16_t ui16_average_x4 = (uint16_t) (ui32_toffset_sum_x4 / TOFFSET_TRACKING_CYCLES);
+
+            // move only 1/4 ADC step every second in both directions, a short load or back pressure can't drag the zero
+            if (ui16_average_x4 < ui16_adc_pedal_torque_zero_x4) {
+                ui16_adc_pedal_torque_zero_x4--;
+            } else if (ui16_average_x4 > ui16_adc_pedal_torque_zero_x4) {
+                ui16_adc_pedal_torque_zero_x4++;
+            }
+
+            ui8_toffset_counter = 0;
+            ui32_toffset_sum_x4 = 0;
+        }
+    } else {
+        // restart zero tracking
+        ui8_toffset_counter = 0;
+        ui32_toffset_sum_x4 = 0;
+    }
+
+    ui16_adc_pedal_torque_offset_x4 = ui16_adc_pedal_torque_zero_x4 + (ADC_TORQUE_SENSOR_CALIBRATION_OFFSET << 2);
+    ui16_adc_pedal_torque_offset = ui16_adc_pedal_torque_offset_x4 >> 2;
+}
+
+static void get_pedal_torque(void) {
+    uint16_t ui16_adc_pedal_torque_delta_x4;
+
+    get_adc_pedal_torque_oversampled();
+
+    calc_pedal_torque_offset();
+
+    // no torque until the offset is calibrated
+    if (!ui8_torque_offset_calibrated) {
+        ui16_adc_pedal_torque_x4 = ui16_adc_pedal_torque_offset_x4;
+    }
+
+    // 10 bit value for the functions that work on ADC steps
+    ui16_adc_pedal_torque = ui16_adc_pedal_torque_x4 >> 2;
+
+    // calculate the delta value of adc pedal torque and the adc pedal torque offset from calibration
+    if (ui16_adc_pedal_torque_x4 > ui16_adc_pedal_torque_offset_x4) {
+        ui16_adc_pedal_torque_delta_x4 = ui16_adc_pedal_torque_x4 - ui16_adc_pedal_torque_offset_x4;
+    } else {
+        ui16_adc_pedal_torque_delta_x4 = 0;
+    }
+    ui16_adc_pedal_torque_delta = ui16_adc_pedal_torque_delta_x4 >> 2;
+
+    // coaster brake threshold follows the pedal torque offset, frozen while pedaling backwards or braking
+    // so a held coaster brake can't move its own threshold
+    if ((!ui8_pas_backward) && (!ui8_brake_state)) {
+        uint16_t ui16_threshold = 0;
+
+        if ((ui8_coaster_brake_torque_threshold) && (ui8_torque_offset_calibrated) &&
+            (ui16_adc_pedal_torque_offset > ui8_coaster_brake_torque_threshold)) {
+            ui16_threshold = ui16_adc_pedal_torque_offset - ui8_coaster_brake_torque_threshold;
+        }
+
+        disableInterrupts();
+        ui16_adc_coaster_brake_threshold = ui16_threshold;
+        enableInterrupts();
+    }
+
+  if ((ui8_torque_linearization_enabled) && (ui8_packet_type != UART_PACKET_CONFIG)){
+   // linearize and calculate weight on pedals
+  linearize_torque_sensor_to_kgs(&ui16_adc_pedal_torque_delta, &ui16_m_torque_sensor_weight_x10);
+  ui16_pedal_torque_x100 = ui16_m_torque_sensor_weight_x10 * 17; 
+  }else{
+  // calculate torque on pedals
+  ui16_pedal_torque_x100 = ((uint32_t) ui16_adc_pedal_torque_delta_x4 * m_configuration_variables.ui8_pedal_torque_per_10_bit_ADC_step_x100) >> 2; // default = 67
+  }
+
+  }
+
+
+  
+static void calc_crank_sector_torque(void)
+{
+  uint32_t ui32_adc_torque_sum;
+  uint16_t ui16_adc_torque_count;
+  uint8_t ui8_crank_sector_counter_temp;
+  uint8_t ui8_i;
+
+  // take the torque samples accumulation latched at the last crank sector start
+  disableInterrupts();
+  ui8_crank_sector_counter_temp = ui8_crank_sector_counter;
+  ui32_adc_torque_sum = ui32_adc_torque_crank_sector_accumulated;
+  ui16_adc_torque_count = ui16_adc_torque_crank_sector_count;
+  enableInterrupts();
+
+  // pedals stopped: all the sectors take the actual torque so the average is valid at the first pedal stroke
+  if (ui16_pedal_cadence_RPM_x10 == 0) {
+    for (ui8_i = 0; ui8_i < CRANK_SECTORS; ui8_i++) {
+      ui16_adc_torque_crank_sector_x4[ui8_i] = ui16_adc_pedal_torque_x4;
+    }
+  }
+  // new crank sector: save the average torque of the sector just completed
+  else if (ui8_crank_sector_counter_temp != ui8_crank_sector_counter_old) {
+    uint32_t ui32_adc_torque_sector_sum = ui32_adc_torque_sum - ui32_adc_torque_crank_sector_accumulated_old;
+    uint16_t ui16_adc_torque_sector_count = ui16_adc_torque_count - ui16_adc_torque_crank_sector_count_old;
+
+    if (ui16_adc_torque_sector_count) {
+      if (++ui8_crank_sector_index >= CRANK_SECTORS) { ui8_crank_sector_index = 0; }
+      ui16_adc_torque_crank_sector_x4[ui8_crank_sector_index] = (uint16_t) ((ui32_adc_torque_sector_sum << 2) / ui16_adc_torque_sector_count);
+    }
+  }
+
+  ui8_crank_sector_counter_old = ui8_crank_sector_counter_temp;
+  ui32_adc_torque_crank_sector_accumulated_old = ui32_adc_torque_sum;
+  ui16_adc_torque_crank_sector_count_old = ui16_adc_torque_count;
+}
+
+
+
+static void calc_human_power(void)
+{
+  uint32_t ui32_adc_torque_sum = 0;
+  uint16_t ui16_adc_torque_delta_x4[CRANK_SECTORS];
+  uint16_t ui16_half_sum;
+  uint16_t ui16_half_sum_min = 0xffff;
+  uint8_t ui8_half_start = 0;
+  uint8_t ui8_i;
+
+  // torque over offset for each crank sector
+  for (ui8_i = 0; ui8_i < CRANK_SECTORS; ui8_i++) {
+    uint16_t ui16_temp = ui16_adc_torque_crank_sector_x4[ui8_i];
+    ui16_adc_torque_delta_x4[ui8_i] = (ui16_temp > ui16_adc_pedal_torque_offset_x4) ? (ui16_temp - ui16_adc_pedal_torque_offset_x4) : 0;
+    ui32_adc_torque_sum += ui16_temp;
+  }
+
+  // average torque of the last revolution
+  ui16_adc_pedal_torque_revolution_x4 = (uint16_t) mul_u32_q16(ui32_adc_torque_sum, (uint16_t) ((65536UL / CRANK_SECTORS) + 1));
+
+  // human power = torque (Nm) * cadence (RPM) * 2 * pi / 60
+  if (ui16_adc_pedal_torque_revolution_x4 > ui16_adc_pedal_torque_offset_x4) {
+    uint32_t ui32_pedal_torque_x100 = ((uint32_t) (ui16_adc_pedal_torque_revolution_x4 - ui16_adc_pedal_torque_offset_x4) * m_configuration_variables.ui8_pedal_torque_per_10_bit_ADC_step_x100) >> 2;
+    ui16_human_power = ui16_sat_u32(mul_u32_q16(ui32_pedal_torque_x100 * ui16_pedal_cadence_RPM_x10, HUMAN_POWER_PER_TORQUE_CADENCE_Q22) >> 6);
+  } else {
+    ui16_human_power = 0;
+  }
+
+  // leg balance: the revolution is split at the dead centres, where the sum of two opposite sectors is minimum
+  for (ui8_i = 0; ui8_i < CRANK_SECTORS_HALF; ui8_i++) {
+    ui16_half_sum = ui16_adc_torque_delta_x4[ui8_i] + ui16_adc_torque_delta_x4[ui8_i + CRANK_SECTORS_HALF];
+    if (ui16_half_sum < ui16_half_sum_min) {
+      ui16_half_sum_min = ui16_half_sum;
+      ui8_half_start = ui8_i;
+    }
+  }
+
+  ui32_adc_torque_sum = 0;
+  for (ui8_i = 0; ui8_i < CRANK_SECTORS; ui8_i++) {
+    ui32_adc_torque_sum += ui16_adc_torque_delta_x4[ui8_i];
+  }
+
+  if (ui32_adc_torque_sum && ui16_pedal_cadence_RPM_x10) {
+    uint32_t ui32_adc_torque_half_sum = 0;
+    for (ui8_i = ui8_half_start; ui8_i < (ui8_half_start + CRANK_SECTORS_HALF); ui8_i++) {
+      ui32_adc_torque_half_sum += ui16_adc_torque_delta_x4[ui8_i];
+    }
+    ui8_leg_balance = (uint8_t) ((ui32_adc_torque_half_sum * 100U) / ui32_adc_torque_sum);
+  } else {
+    ui8_leg_balance = 50;
+  }
+}
+
 
-        // calculate integral
-        i16_integral = i16_integral + i16_error;
 
-        // limit integral
-        if (i16_integral > CRUISE_PID_INTEGRAL_LIMIT) {
-            i16_integral = CRUISE_PID_INTEGRAL_LIMIT;
-        } else if (i16_integral < 0) {
-            i16_integral = 0;
-        }
+static void calc_road_load(void)
+{
+  static uint8_t  ui8_counter;
+  static uint32_t ui32_power_accumulated;
+  static uint16_t ui16_wheel_speed_x10_old;
 
-        // calculate derivative
-        i16_derivative = i16_error - i16_last_error;
+  // power at the wheel: motor power from the battery power and the drive efficiency, plus the human power
+  ui32_power_accumulated += (((uint32_t) ui16_adc_battery_voltage_filtered * ui8_adc_battery_current_filtered * ROAD_LOAD_MOTOR_POWER_X4096) >> 12) + ui16_human_power;
 
-        // save error to last error
-        i16_last_error = i16_error;
+  if (++ui8_counter < ROAD_LOAD_UPDATE_CYCLES) { return; }
+  ui8_counter = 0;
 
-        // calculate control output ( output =  P I D )
-        i16_control_output = (i16_cruise_pid_kp * i16_error) + (i16_cruise_pid_ki * i16_integral) + (CRUISE_PID_KD * i16_derivative);
+  uint16_t ui16_power = (uint16_t) mul_u32_q16(ui32_power_accumulated, DIVIDE_BY_10_Q16);
+  ui32_power_accumulated = 0;
 
-        // limit control output to just positive values
-        if (i16_control_output < 0) {
-            i16_control_output = 0;
-        }
+  int16_t i16_speed_delta_x10 = (int16_t) ui16_wheel_speed_x10 - (int16_t) ui16_wheel_speed_x10_old;
+  ui16_wheel_speed_x10_old = ui16_wheel_speed_x10;
 
-        // limit control output to the maximum value
-        if (i16_control_output > 1000) {
-            i16_control_output = 1000;
-        }
+  // no estimation at low speed, when braking or on speed glitches, the last grade fades out slowly
+  if ((ui16_wheel_speed_x10 < ROAD_LOAD_SPEED_MIN_X10) || ui8_brake_state ||
+      (i16_speed_delta_x10 > ROAD_LOAD_SPEED_DELTA_MAX_X10) || (i16_speed_delta_x10 < -ROAD_LOAD_SPEED_DELTA_MAX_X10)) {
+    if (i16_road_grade_x10 > 0) { i16_road_grade_x10--; }
+    else if (i16_road_grade_x10 < 0) { i16_road_grade_x10++; }
+    ui16_road_load_force_x10 = 0;
+    return;
+  }
 
-        // set motor acceleration
-        ui8_duty_cycle_ramp_up_inverse_step = CRUISE_DUTY_CYCLE_RAMP_UP_INVERSE_STEP;
-        ui8_duty_cycle_ramp_down_inverse_step = PWM_DUTY_CYCLE_RAMP_DOWN_INVERSE_STEP_DEFAULT;
+  /*------------------------------------------------------------------------
 
-        // set battery current target
-        ui8_adc_battery_current_target = ui8_adc_battery_current_max;
+    NOTE: regarding the road load estimation
 
-        // set duty cycle target  |  map the control output to an appropriate target PWM value
-        ui8_duty_cycle_target = map_ui8((uint8_t) (i16_control_output >> 2),
-                (uint8_t)0,                   // minimum control output from PID
-                (uint8_t)250,                 // maximum control output from PID
-                (uint8_t)0,                   // minimum duty cycle
-                (uint8_t)(PWM_DUTY_CYCLE_MAX-1)); // maximum duty cycle
-    }
-}
+    Longitudinal model, forces in N x10 and speed v in km/h x10:
 
+    F = P / (v / 36)                      power at the wheel
+    F inertia = m * dv / 250ms / 36       acceleration of rider and bike
+    F road = F - F inertia                = F rolling + F aero + F grade
+    F rolling = m * 9.81 * 0.008
+    F aero = 0.5 * 1.2 * 0.5 * (v / 36)^2
+    grade (%) = F grade / (m * 9.81) * 100
 
+    Three divisions every 250ms, the rest are constants x65536.
 
-static void apply_throttle() {
+  ------------------------------------------------------------------------*/
 
-    // map value from 0 to 255
-    ui8_adc_throttle = map_ui8((uint8_t)(ui16_adc_throttle >> 2),
-            (uint8_t) ADC_THROTTLE_MIN_VALUE,
-            (uint8_t) ADC_THROTTLE_MAX_VALUE,
-            (uint8_t) 0,
-            (uint8_t) 255);
+  int32_t i32_force_x10 = (int32_t) (((uint32_t) ui16_power * 360U) / ui16_wheel_speed_x10);
+  i32_force_x10 -= ((int32_t) ui8_road_load_mass_kg * i16_speed_delta_x10 * (int16_t) (10 * 1000 / (ROAD_LOAD_UPDATE_CYCLES * 25))) / 36;
 
-    // map ADC throttle value from 0 to max battery current
-    uint8_t ui8_adc_battery_current_target_throttle = map_ui8((uint8_t) ui8_adc_throttle,
-            (uint8_t) 0,
-            (uint8_t) 255,
-            (uint8_t) 0,
-            (uint8_t) ui8_adc_battery_current_max);
+  // steady state road load
+  ui16_road_load_force_x10 = (i32_force_x10 > 0) ? ui16_sat_u32((uint32_t) i32_force_x10) : 0;
 
-    if (ui8_adc_battery_current_target_throttle > ui8_adc_battery_current_target) {
-        // set motor acceleration
-        if (ui16_wheel_speed_x10 >= 255) {
-            ui8_duty_cycle_ramp_up_inverse_step = PWM_DUTY_CYCLE_RAMP_UP_INVERSE_STEP_MIN;
-            ui8_duty_cycle_ramp_down_inverse_step = PWM_DUTY_CYCLE_RAMP_DOWN_INVERSE_STEP_MIN;
-        } else {
-            ui8_duty_cycle_ramp_up_inverse_step = map_ui8((uint8_t) ui16_wheel_speed_x10,
-                    (uint8_t) 40,
-                    (uint8_t) 255,
-                    (uint8_t) THROTTLE_DUTY_CYCLE_RAMP_UP_INVERSE_STEP_DEFAULT,
-                    (uint8_t) THROTTLE_DUTY_CYCLE_RAMP_UP_INVERSE_STEP_MIN);
-
-            ui8_duty_cycle_ramp_down_inverse_step = map_ui8((uint8_t) ui16_wheel_speed_x10,
-                    (uint8_t) 40,
-                    (uint8_t) 255,
-                    (uint8_t) PWM_DUTY_CYCLE_RAMP_DOWN_INVERSE_STEP_DEFAULT,
-                    (uint8_t) PWM_DUTY_CYCLE_RAMP_DOWN_INVERSE_STEP_MIN);
-        }
-        // set battery current target
-        ui8_adc_battery_current_target = ui8_adc_battery_current_target_throttle;
+  // what is left after rolling and aerodynamic resistance is the grade resistance
+  i32_force_x10 -= (int32_t) mul_u32_q16((uint32_t) ui8_road_load_mass_kg, ROAD_LOAD_ROLLING_FORCE_X10_PER_KG_Q16);
+  i32_force_x10 -= (int32_t) mul_u32_q16((uint32_t) ui16_wheel_speed_x10 * ui16_wheel_speed_x10, ROAD_LOAD_AERO_FORCE_X10_Q16);
 
-        // set duty cycle target
-        ui8_duty_cycle_target = PWM_DUTY_CYCLE_MAX;
-    }
+  int32_t i32_grade_x10 = (i32_force_x10 * ROAD_LOAD_GRADE_X10_PER_FORCE_X10) / ((int16_t) ui8_road_load_mass_kg * 10);
+  if (i32_grade_x10 > ROAD_LOAD_GRADE_X10_MAX) { i32_grade_x10 = ROAD_LOAD_GRADE_X10_MAX; }
+  else if (i32_grade_x10 < -ROAD_LOAD_GRADE_X10_MAX) { i32_grade_x10 = -ROAD_LOAD_GRADE_X10_MAX; }
+
+  // filter, acceleration makes the single estimations noisy
+  i16_road_grade_x10 += ((int16_t) i32_grade_x10 - i16_road_grade_x10) >> ROAD_LOAD_GRADE_FILTER_COEFFICIENT;
 }
 
 
 
-static void apply_temperature_limiting()
+static void add_histogram_sample(uint16_t *p_histogram, uint8_t ui8_bin)
 {
-  
-  // get ADC measurement
-  volatile uint16_t ui16_temp = ui16_adc_throttle;
-  
-  // filter ADC measurement to motor temperature variable
-  ui16_adc_motor_temperature_filtered = filter(ui16_temp, ui16_adc_motor_temperature_filtered, 8);
-  
-    // convert ADC value
-  ui8_motor_temperature_filtered = (uint8_t)((ui16_adc_motor_temperature_filtered * 39) / 80);
+  uint8_t ui8_i;
 
-    // min temperature value can not be equal or higher than max temperature value
-  if (ui8_motor_temperature_min_value_to_limit >= ui8_motor_temperature_max_value_to_limit) {
-        ui8_adc_battery_current_target = 0;
-    } else {
-        // adjust target current if motor over temperature limit
-        ui8_adc_battery_current_target = map_ui8(ui8_motor_temperature_filtered,
-                ui8_motor_temperature_min_value_to_limit,
-                ui8_motor_temperature_max_value_to_limit,
-                ui8_adc_battery_current_target,
-                0);
+  // halve all the bins when one saturates, so the distribution is kept
+  if (++p_histogram[ui8_bin] == 0xffff) {
+    for (ui8_i = 0; ui8_i < RIDE_STATISTICS_HISTOGRAM_SIZE; ui8_i++) {
+      p_histogram[ui8_i] >>= 1;
     }
+  }
 }
 
 
 
-static void apply_speed_limit() 
+static void add_ride_statistics_sample(uint8_t ui8_bucket, uint16_t ui16_power_adc)
 {
-    if (m_configuration_variables.ui8_wheel_speed_max > 0) {
-        // set battery current target limit based on speed limit, faster versions works up to limit of 90km/h
-        if (m_configuration_variables.ui8_wheel_speed_max > 50) { // shift down to avoid use of slow map_ui16 function
-            ui8_adc_battery_current_target = map_ui8((uint8_t)((ui16_wheel_speed_x10 >> 1) - 200),
-                (uint8_t)(((uint16_t)(m_configuration_variables.ui8_wheel_speed_max) * (uint8_t)5U) - (uint8_t)210U),
-                (uint8_t)(((uint16_t)(m_configuration_variables.ui8_wheel_speed_max) * (uint8_t)5U) - (uint8_t)195U),
-                ui8_adc_battery_current_target,
-                0);
-        } else {
-            ui8_adc_battery_current_target = map_ui8((uint8_t)(ui16_wheel_speed_x10 >> 1),
-                (uint8_t)(((uint8_t)(m_configuration_variables.ui8_wheel_speed_max) * (uint8_t)5U) - (uint8_t)10U), // ramp down from 2km/h under
-                (uint8_t)(((uint8_t)(m_configuration_variables.ui8_wheel_speed_max) * (uint8_t)5U) + (uint8_t)5U), // to 1km/h over
-                ui8_adc_battery_current_target,
-                0);
-        } 
-    }
+  // time in seconds
+  if (++ui8_ride_time_counter[ui8_bucket] >= RIDE_STATISTICS_SECOND_CYCLES) {
+    ui8_ride_time_counter[ui8_bucket] = 0;
+    if (ui16_ride_time[ui8_bucket] < 0xffff) { ui16_ride_time[ui8_bucket]++; }
+  }
+
+  // energy in Wh x10
+  ui32_ride_energy_accumulated[ui8_bucket] += ui16_power_adc;
+  if (ui32_ride_energy_accumulated[ui8_bucket] >= RIDE_STATISTICS_ENERGY_UNIT) {
+    ui32_ride_energy_accumulated[ui8_bucket] -= RIDE_STATISTICS_ENERGY_UNIT;
+    if (ui16_ride_energy_x10[ui8_bucket] < 0xffff) { ui16_ride_energy_x10[ui8_bucket]++; }
+  }
 }
 
 
 
-static void calc_wheel_speed(void)
-{ 
-  // calc wheel speed in km/h
-  if (ui16_wheel_speed_sensor_ticks)
-  {
-  uint16_t ui16_tmp = ui16_wheel_speed_sensor_ticks;
-  // !!!warning if PWM_CYCLES_SECOND is not a multiple of 1000
-  ui16_wheel_speed_x10 = ((uint32_t)m_configuration_variables.ui16_wheel_perimeter * ((PWM_CYCLES_SECOND/1000)*36U)) / ui16_tmp;	
-  }
-  else
-  {
-    ui16_wheel_speed_x10 = 0;
+static void calc_ride_statistics(void)
+{
+  uint8_t ui8_adc_battery_current = ui8_adc_battery_current_filtered;
+  uint8_t ui8_duty_cycle = ui8_g_duty_cycle;
+  uint8_t ui8_x;
+  uint8_t ui8_y;
+
+  // battery power in ADC voltage steps x ADC current steps, limited to 16 bit
+  uint32_t ui32_power_adc = (uint32_t) ui16_adc_battery_voltage_filtered * ui8_adc_battery_current;
+  uint16_t ui16_power_adc = (ui32_power_adc > 0xffff) ? 0xffff : (uint16_t) ui32_power_adc;
+
+  // operating point histograms only when the motor is running
+  if (ui8_duty_cycle) {
+    ui8_x = (ui16_motor_speed_erps >> 6) > 7 ? 7 : (uint8_t)(ui16_motor_speed_erps >> 6);
+    ui8_y = ui8_min(ui8_adc_battery_current >> 4, 7);
+    add_histogram_sample(ui16_histogram_erps_current, (uint8_t)((ui8_x << 3) + ui8_y));
+
+    ui8_x = ui8_duty_cycle >> 5;
+    ui8_y = ui8_min(ui8_g_foc_angle >> 3, 7);
+    add_histogram_sample(ui16_histogram_duty_cycle_foc_angle, (uint8_t)((ui8_x << 3) + ui8_y));
   }
-}
 
+  // time and energy per riding mode
+  if (ui8_riding_mode < RIDE_STATISTICS_RIDING_MODES) {
+    add_ride_statistics_sample(ui8_riding_mode, ui16_power_adc);
+  }
 
+  // time and energy in field weakening
+  if (ui8_fw_hall_counter_offset) {
+    add_ride_statistics_sample(RIDE_STATISTICS_FIELD_WEAKENING, ui16_power_adc);
+  }
 
-static void calc_cadence(void) {
-	
-    // get the cadence sensor ticks
-    uint16_t ui16_cadence_sensor_ticks_temp = ui16_cadence_sensor_ticks;
+  // time and energy limited by battery current
+  if (ui8_duty_cycle && (ui8_duty_cycle < ui8_controller_duty_cycle_target) &&
+      (ui8_adc_battery_current >= ui8_controller_adc_battery_current_target)) {
+    add_ride_statistics_sample(RIDE_STATISTICS_CURRENT_LIMIT, ui16_power_adc);
+  }
 
-    // adjust cadence sensor ticks counter min depending on wheel speed
-    uint8_t ui8_temp = map_ui8((uint8_t)(ui16_wheel_speed_x10 >> 2),
-            10 /* 40 >> 2 */,
-            100 /* 400 >> 2 */,
-            (CADENCE_SENSOR_CALC_COUNTER_MIN >> 4),
-            (CADENCE_SENSOR_TICKS_COUNTER_MIN_AT_SPEED >> 4));
+  // time and energy limited by speed
+  if (ui8_speed_limit_active) {
+    add_ride_statistics_sample(RIDE_STATISTICS_SPEED_LIMIT, ui16_power_adc);
+  }
+}
 
-    ui16_cadence_ticks_count_min_speed_adj = (uint16_t)ui8_temp << 4;
 
-	// calculate cadence in RPM and avoid zero division
-	if (ui16_cadence_sensor_ticks_temp)
-		ui8_pedal_cadence_RPM = (PWM_CYCLES_SECOND * 3U) / ui16_cadence_sensor_ticks_temp;
-	else
-		ui8_pedal_cadence_RPM = 0;
 
-      /*-------------------------------------------------------------------------------------------------
-      
-        NOTE: regarding the cadence calculation
-        Cadence in standard mode is calculated by counting how many ticks there are between two 
-        transitions of LOW to HIGH.
-        
-        Formula for calculating the cadence in RPM:
-        (1) Cadence in RPM = (60 * PWM_CYCLES_SECOND) / CADENCE_SENSOR_NUMBER_MAGNETS) / ticks
-		(2) Cadence in RPM = (PWM_CYCLES_SECOND * 3) / ticks
-        
-      -------------------------------------------------------------------------------------------------*/
+static void reset_ride_statistics(void)
+{
+  memset(ui16_histogram_erps_current, 0, sizeof(ui16_histogram_erps_current));
+  memset(ui16_histogram_duty_cycle_foc_angle, 0, sizeof(ui16_histogram_duty_cycle_foc_angle));
+  memset(ui16_ride_time, 0, sizeof(ui16_ride_time));
+  memset(ui16_ride_energy_x10, 0, sizeof(ui16_ride_energy_x10));
+  memset(ui8_ride_time_counter, 0, sizeof(ui8_ride_time_counter));
+  memset(ui32_ride_energy_accumulated, 0, sizeof(ui32_ride_energy_accumulated));
 }
 
 
 
-
-static void get_battery_voltage_filtered(void)
+static uint16_t get_ride_statistics_word(uint8_t ui8_index)
 {
-  ui16_battery_voltage_filtered_x1000 = ui16_adc_battery_voltage_filtered * BATTERY_VOLTAGE_PER_10_BIT_ADC_STEP_X1000;
-}
+  // words order: ERPS x current histogram, duty cycle x FOC angle histogram, time per bucket, energy per bucket
+  if (ui8_index < RIDE_STATISTICS_HISTOGRAM_SIZE) { return ui16_histogram_erps_current[ui8_index]; }
+  ui8_index -= RIDE_STATISTICS_HISTOGRAM_SIZE;
 
+  if (ui8_index < RIDE_STATISTICS_HISTOGRAM_SIZE) { return ui16_histogram_duty_cycle_foc_angle[ui8_index]; }
+  ui8_index -= RIDE_STATISTICS_HISTOGRAM_SIZE;
 
+  if (ui8_index < RIDE_STATISTICS_NR_BUCKETS) { return ui16_ride_time[ui8_index]; }
+  ui8_index -= RIDE_STATISTICS_NR_BUCKETS;
 
+  if (ui8_index < RIDE_STATISTICS_NR_BUCKETS) { return ui16_ride_energy_x10[ui8_index]; }
 
-static void get_battery_current_filtered(void)
-{
-  ui8_battery_current_filtered_x10 = (uint16_t)(ui8_adc_battery_current_filtered * (uint8_t)BATTERY_CURRENT_PER_10_BIT_ADC_STEP_X100) / 10;
+  return 0;
 }
 
 
 
-static void linearize_torque_sensor_to_kgs(uint16_t *ui16_p_torque_sensor_adc_steps, uint16_t *ui16_torque_sensor_weight_x10)
+static void calc_battery_consumption(void)
 {
-  uint16_t ui16_array_sum[TORQUE_SENSOR_LINEARIZE_NR_POINTS];
-  uint8_t ui8_end = 0;
-  uint16_t ui16_p_torque_sensor_adc_absolute_steps;
-
-  memset(ui16_array_sum, 0, sizeof(ui16_array_sum));
+  uint8_t ui8_adc_battery_current = ui8_adc_battery_current_filtered;
 
-  if(*ui16_p_torque_sensor_adc_steps > 0){
-  ui16_p_torque_sensor_adc_absolute_steps = *ui16_p_torque_sensor_adc_steps + ui16_adc_pedal_torque_offset;
+  if (ui8_adc_battery_current == 0) { return; }
 
-  if(ui16_p_torque_sensor_adc_absolute_steps < ui16_torque_sensor_linear_values[2])
-  {
-    ui16_array_sum[0] = *ui16_p_torque_sensor_adc_steps;
-    ui8_end = 1;
-  }
-  else
-  {
-    ui16_array_sum[0] = ui16_torque_sensor_linear_values[2] - ui16_adc_pedal_torque_offset;
+  // charge in mAh x10
+  ui16_battery_charge_accumulated += ui8_adc_battery_current;
+  if (ui16_battery_charge_accumulated >= BATTERY_CHARGE_UNIT) {
+    ui16_battery_charge_accumulated -= BATTERY_CHARGE_UNIT;
+    ui32_battery_charge_consumed_x10++;
+    ui8_battery_consumption_saved = 0;
   }
 
-  if(ui8_end == 0)
-  {
-    if(ui16_p_torque_sensor_adc_absolute_steps < ui16_torque_sensor_linear_values[4])
-    {
-      ui16_array_sum[1] = (ui16_p_torque_sensor_adc_absolute_steps - ui16_torque_sensor_linear_values[2]);
-      ui8_end = 1;
-    }
-    else
-    {
-      ui16_array_sum[1] = ui16_torque_sensor_linear_values[4] - ui16_torque_sensor_linear_values[2];
-    }
+  // energy in Wh x100
+  ui32_battery_energy_accumulated += (uint32_t) ui16_adc_battery_voltage_filtered * ui8_adc_battery_current;
+  while (ui32_battery_energy_accumulated >= BATTERY_ENERGY_UNIT) {
+    ui32_battery_energy_accumulated -= BATTERY_ENERGY_UNIT;
+    ui32_battery_energy_consumed_x100++;
   }
+}
 
-  if(ui8_end == 0)
-  {
-    if(ui16_p_torque_sensor_adc_absolute_steps < ui16_torque_sensor_linear_values[6])
-    {
-      ui16_array_sum[2] = (ui16_p_torque_sensor_adc_absolute_steps - ui16_torque_sensor_linear_values[4]);
-      ui8_end = 1;
-    }
-    else
-    {
-      ui16_array_sum[2] = ui16_torque_sensor_linear_values[6] - ui16_torque_sensor_linear_values[4];
-    }
-  }
 
-  if(ui8_end == 0)
-  {
-    if(ui16_p_torque_sensor_adc_absolute_steps < ui16_torque_sensor_linear_values[8])
-    {
-      ui16_array_sum[3] = (ui16_p_torque_sensor_adc_absolute_steps - ui16_torque_sensor_linear_values[6]);
-      ui8_end = 1;
-    }
-    else
-    {
-      ui16_array_sum[3] = ui16_torque_sensor_linear_values[8] - ui16_torque_sensor_linear_values[6];
-    }
-  }
 
-    if(ui8_end == 0)
-  {
-    if(ui16_p_torque_sensor_adc_absolute_steps < ui16_torque_sensor_linear_values[10])
-    {
-      ui16_array_sum[4] = (ui16_p_torque_sensor_adc_absolute_steps - ui16_torque_sensor_linear_values[8]);
-      ui8_end = 1;
-    }
-    else
-    {
-      ui16_array_sum[4] = ui16_torque_sensor_linear_values[10] - ui16_torque_sensor_linear_values[8];
-    }
-  }
-  
-  if(ui8_end == 0)
-  {
-    ui16_array_sum[5] = ui16_p_torque_sensor_adc_absolute_steps - ui16_torque_sensor_linear_values[10];
+static void save_battery_consumption(void)
+{
+  // count the time the motor is stopped
+  if (ui8_g_duty_cycle) { ui16_battery_consumption_idle_counter = 0; }
+  else if (ui16_battery_consumption_idle_counter < BATTERY_CONSUMPTION_SAVE_IDLE_CYCLES) { ui16_battery_consumption_idle_counter++; }
+
+  // save only with the motor stopped: at power down (battery voltage under cut off or display switched off) or after some idle time
+  if ((!ui8_battery_consumption_saved) && (ui8_g_duty_cycle == 0) &&
+      ((ui16_adc_battery_voltage_filtered < ui16_adc_voltage_cut_off) ||
+       (ui8_missed_uart_packets > 50) ||
+       (ui16_battery_consumption_idle_counter >= BATTERY_CONSUMPTION_SAVE_IDLE_CYCLES))) {
+
+    eeprom_write_uint32(ADDRESS_BATTERY_CHARGE_CONSUMED_X10, ui32_battery_charge_consumed_x10);
+    eeprom_write_uint32(ADDRESS_BATTERY_ENERGY_CONSUMED_X100, ui32_battery_energy_consumed_x100);
+    ui8_battery_consumption_saved = 1;
   }
+}
 
-  *ui16_torque_sensor_weight_x10 = 
-     (ui16_array_sum[0] * ui16_torque_sensor_linear_values[1] +
-      ui16_array_sum[1] * ui16_torque_sensor_linear_values[3] +
-      ui16_array_sum[2] * ui16_torque_sensor_linear_values[5] +
-      ui16_array_sum[3] * ui16_torque_sensor_linear_values[7] +
-      ui16_array_sum[4] * ui16_torque_sensor_linear_values[9] +
-	  ui16_array_sum[5] * ui16_torque_sensor_linear_values[11]) / 10;
-  }
-  // no torque_sensor_adc_steps
-  else
-  {
-    *ui16_torque_sensor_weight_x10 = 0;
+
+static void load_assist_curves(void)
+{
+  uint8_t ui8_curve;
+  uint8_t ui8_point;
+  uint8_t ui8_address = ADDRESS_ASSIST_CURVES;
+  
+  for (ui8_curve = 0; ui8_curve < ASSIST_CURVES_NR; ui8_curve++) {
+    // not in use if never saved or not valid
+    m_assist_curves[ui8_curve].ui8_nr_points = eeprom_read_byte(ui8_address);
+    if (m_assist_curves[ui8_curve].ui8_nr_points > CURVE_NR_POINTS_MAX) { m_assist_curves[ui8_curve].ui8_nr_points = 0; }
+    
+    for (ui8_point = 0; ui8_point < CURVE_NR_POINTS_MAX; ui8_point++) {
+      m_assist_curves[ui8_curve].ui16_x[ui8_point] = eeprom_read_uint16(ui8_address + 1 + (ui8_point << 2));
+      m_assist_curves[ui8_curve].ui16_y[ui8_point] = eeprom_read_uint16(ui8_address + 3 + (ui8_point << 2));
+    }
+    
+    ui8_address += ASSIST_CURVE_EEPROM_SIZE;
   }
 }
 
 
+static uint8_t get_assist_curve_eeprom_byte(struct_curve *p_curve, uint8_t ui8_index)
+{
+  uint16_t ui16_value;
+  
+  // number of points, then x and y of each point, little endian
+  if (!ui8_index) { return p_curve->ui8_nr_points; }
+  ui8_index--;
+  ui16_value = (ui8_index & 2) ? p_curve->ui16_y[ui8_index >> 2] : p_curve->ui16_x[ui8_index >> 2];
+  return (ui8_index & 1) ? (uint8_t) (ui16_value >> 8) : (uint8_t) ui16_value;
+}
 
-#define TOFFSET_START_CYCLES 160 // Torque offset calculation stars after 160 cycles = 4sec (25ms*160)
-#define TOFFSET_END_CYCLES 200   // Torque offset calculation ends after 200 cycles = 5sec (25ms*200)
-static uint8_t toffset_cycle_counter = 0;
 
-static void get_pedal_torque(void) {
-    if (toffset_cycle_counter < TOFFSET_END_CYCLES) {
-    	if (toffset_cycle_counter > TOFFSET_START_CYCLES) {
-			uint16_t ui16_tmp = ui16_adc_torque;
-			ui16_adc_pedal_torque_offset = filter(ui16_tmp, ui16_adc_pedal_torque_offset, 2);
-    	}
-        toffset_cycle_counter++;
-        if (toffset_cycle_counter == TOFFSET_END_CYCLES) {
-            ui16_adc_pedal_torque_offset += ADC_TORQUE_SENSOR_CALIBRATION_OFFSET;
-        }
-        ui16_adc_pedal_torque = ui16_adc_pedal_torque_offset;
-    } else {
-        // get adc pedal torque
-        ui16_adc_pedal_torque = ui16_adc_torque;
+static void save_assist_curves(void)
+{
+  uint8_t ui8_writes = 0;
+  
+  // start saving the next curve, a change received while saving sets the bit again and the curve is saved once more
+  if (ui8_assist_curve_saving == ASSIST_CURVE_SAVE_NONE) {
+    uint8_t ui8_curve;
+    
+    for (ui8_curve = 0; ui8_curve < ASSIST_CURVES_NR; ui8_curve++) {
+      if (ui8_assist_curves_save & (uint8_t) (1 << ui8_curve)) {
+        ui8_assist_curves_save &= (uint8_t) ~(1 << ui8_curve);
+        ui8_assist_curve_saving = ui8_curve;
+        ui8_assist_curve_save_index = 0;
+        break;
+      }
     }
-
-    // calculate the delta value of adc pedal torque and the adc pedal torque offset from calibration
-    if (ui16_adc_pedal_torque > ui16_adc_pedal_torque_offset) {
-        ui16_adc_pedal_torque_delta = ui16_adc_pedal_torque - ui16_adc_pedal_torque_offset;
-    } else {
-        ui16_adc_pedal_torque_delta = 0;
+    
+    if (ui8_assist_curve_saving == ASSIST_CURVE_SAVE_NONE) { return; }
+  }
+  
+  // only a few changed bytes each cycle and only with the motor stopped, so the control loops never stall
+  while (ui8_assist_curve_save_index < ASSIST_CURVE_EEPROM_SIZE) {
+    uint8_t ui8_address = ADDRESS_ASSIST_CURVES + (ui8_assist_curve_saving * ASSIST_CURVE_EEPROM_SIZE) + ui8_assist_curve_save_index;
+    uint8_t ui8_value = get_assist_curve_eeprom_byte(&m_assist_curves[ui8_assist_curve_saving], ui8_assist_curve_save_index);
+    
+    if (eeprom_read_byte(ui8_address) != ui8_value) {
+      if ((ui8_writes >= ASSIST_CURVE_SAVE_WRITES_PER_CYCLE) || (ui8_g_duty_cycle)) { return; }
+      eeprom_write_byte(ui8_address, ui8_value);
+      ui8_writes++;
     }
-
-  if ((ui8_torque_linearization_enabled) && (ui8_packet_type == UART_PACKET_REGULAR)){
-   // linearize and calculate weight on pedals
-  linearize_torque_sensor_to_kgs(&ui16_adc_pedal_torque_delta, &ui16_m_torque_sensor_weight_x10);
-  ui16_pedal_torque_x100 = ui16_m_torque_sensor_weight_x10 * 17; 
-  }else{
-  // calculate torque on pedals
-  ui16_pedal_torque_x100 = ui16_adc_pedal_torque_delta * m_configuration_variables.ui8_pedal_torque_per_10_bit_ADC_step_x100; // default = 67
+    
+    ui8_assist_curve_save_index++;
   }
+  
+  ui8_assist_curve_saving = ASSIST_CURVE_SAVE_NONE;
+}
 
-  }
 
 
-  
   struct_configuration_variables* get_configuration_variables (void)
 {
   return &m_configuration_variables;
@@ -1036,8 +2664,9 @@ static void check_system()
   
   
   // check torque sensor
-  if (((ui16_adc_pedal_torque_offset > 300) || (ui16_adc_pedal_torque_offset < 10) || (ui16_adc_pedal_torque > 500)) &&
-      ((ui8_riding_mode == POWER_ASSIST_MODE) || (ui8_riding_mode == eMTB_ASSIST_MODE)))
+  if ((ui8_torque_offset_calibrated) &&
+      ((ui16_adc_pedal_torque_offset > 300) || (ui16_adc_pedal_torque_offset < 10) || (ui16_adc_pedal_torque > 500)) &&
+      ((ui8_riding_mode == POWER_ASSIST_MODE) || (ui8_riding_mode == eMTB_ASSIST_MODE) || (ui8_riding_mode == MOTOR_TORQUE_ASSIST_MODE)))
   {
     // set error code
     ui8_system_state = ERROR_TORQUE_SENSOR;
@@ -1459,6 +3088,7 @@ static void uart_receive_package(void)
 	  ui8_field_weakening_enabled = (ui8_temp & 4) >> 2;
 	  ui8_hybrid_mode_enabled = (ui8_temp & 8) >> 3;
 	  ui8_soft_start_feature_enabled = (ui8_temp & 16) >> 4;
+	  ui8_torque_averaging_enabled = (ui8_temp & 32) >> 5;
 	  
 	  if(ui8_packet_type == UART_PACKET_REGULAR){
           
@@ -1475,21 +3105,27 @@ static void uart_receive_package(void)
           uint8_t ui8_motor_acceleration_adjustment = ui8_rx_buffer[9];
           
           // set duty cycle ramp up inverse step
-          ui8_duty_cycle_ramp_up_inverse_step_default = map_ui8((uint8_t)ui8_motor_acceleration_adjustment,
+          uint8_t ui8_ramp_up_inverse_step_default = map_ui8((uint8_t)ui8_motor_acceleration_adjustment,
                         (uint8_t) 0,
                         (uint8_t) 100,
                         (uint8_t) PWM_DUTY_CYCLE_RAMP_UP_INVERSE_STEP_DEFAULT,
                         (uint8_t) PWM_DUTY_CYCLE_RAMP_UP_INVERSE_STEP_MIN);
+          
+          // calculate the motor acceleration tables only when changed
+          if (ui8_ramp_up_inverse_step_default != ui8_duty_cycle_ramp_up_inverse_step_default) {
+            ui8_duty_cycle_ramp_up_inverse_step_default = ui8_ramp_up_inverse_step_default;
+            calc_ramp_tables();
+          }
 		  
           // battery power limit
           m_configuration_variables.ui8_target_battery_max_power_div25 = ui8_rx_buffer[10];
           
           // calculate max battery current in ADC steps from the received battery current limit
-		  uint8_t ui8_adc_battery_current_max_temp_1 = (uint16_t)(ui8_battery_current_max * (uint8_t)100) / BATTERY_CURRENT_PER_10_BIT_ADC_STEP_X100;
+		  uint8_t ui8_adc_battery_current_max_temp_1 = ui8_sat_u16(((uint16_t) ui8_battery_current_max * 100U) >> 4); // / 0.16 A
           
-          // calculate max battery current in ADC steps from the received power limit
-          uint32_t ui32_battery_current_max_x100 = ((uint32_t) m_configuration_variables.ui8_target_battery_max_power_div25 * 2500000) / ui16_battery_voltage_filtered_x1000;
-          uint8_t ui8_adc_battery_current_max_temp_2 = ui32_battery_current_max_x100 / BATTERY_CURRENT_PER_10_BIT_ADC_STEP_X100;
+          // calculate max battery current in ADC steps from the received power limit, with the battery voltage reciprocal
+          uint8_t ui8_adc_battery_current_max_temp_2 = ui8_sat_u16(ui16_sat_u32(mul_u32_q16((uint32_t) m_configuration_variables.ui8_target_battery_max_power_div25 * 2500U,
+              ui16_adc_battery_current_per_power_x100_q22) >> 6));
 
           //  correct 0 Max Power setting on display
 		  if (m_configuration_variables.ui8_target_battery_max_power_div25 == 0){ui8_adc_battery_current_max_temp_2 = ui8_adc_battery_current_max_temp_1;}
@@ -1499,12 +3135,30 @@ static void uart_receive_package(void)
 
 	} 
 	
+	  if(ui8_packet_type == UART_PACKET_STATISTICS){
+
+          // requested ride statistics page
+          ui8_ride_statistics_page = ui8_rx_buffer [6];
+          if (ui8_ride_statistics_page >= RIDE_STATISTICS_NR_PAGES) { ui8_ride_statistics_page = 0; }
+
+          // reset ride statistics
+          if (ui8_rx_buffer [7] & 1) { reset_ride_statistics(); }
+
+          // reset battery consumption, after the battery is charged
+          if (ui8_rx_buffer [7] & 2) {
+            ui32_battery_charge_consumed_x10 = 0;
+            ui32_battery_energy_consumed_x100 = 0;
+            ui8_battery_consumption_saved = 0;
+          }
+	  }
+	
 	  if(ui8_packet_type == UART_PACKET_CONFIG){ // recieved only on power up so after changing values user must restart bike (power down/up bike)
 	  
       switch (ui8_message_ID)
       {
         case 0:
 
+		ui8_torque_sensor_linear_update = 1;
 		ui16_torque_sensor_linear_values[0] = ui8_rx_buffer [6];
         ui16_torque_sensor_linear_values[1] = (((uint16_t) ui8_rx_buffer [8]) << 8) + ((uint16_t) ui8_rx_buffer [7]);  
         m_configuration_variables.ui8_hall_ref_angles[0] = ui8_rx_buffer[9];
@@ -1514,6 +3168,7 @@ static void uart_receive_package(void)
 
         case 1:
         
+        ui8_torque_sensor_linear_update = 1;
         ui16_torque_sensor_linear_values[2] = (((uint16_t) ui8_rx_buffer [7]) << 8) + ((uint16_t) ui8_rx_buffer [6]);
 		ui16_torque_sensor_linear_values[3] = ui8_rx_buffer [8];
 		m_configuration_variables.ui8_hall_ref_angles[1] = ui8_rx_buffer[9];
@@ -1523,6 +3178,7 @@ static void uart_receive_package(void)
 
         case 2:
 		
+        ui8_torque_sensor_linear_update = 1;
         ui16_torque_sensor_linear_values[4] = (((uint16_t) ui8_rx_buffer [7]) << 8) + ((uint16_t) ui8_rx_buffer [6]);
 		ui16_torque_sensor_linear_values[5] = ui8_rx_buffer [8];
 		m_configuration_variables.ui8_hall_ref_angles[2] = ui8_rx_buffer[9];
@@ -1532,6 +3188,7 @@ static void uart_receive_package(void)
 
         case 3:
         
+        ui8_torque_sensor_linear_update = 1;
         ui16_torque_sensor_linear_values[6] = (((uint16_t) ui8_rx_buffer [7]) << 8) + ((uint16_t) ui8_rx_buffer [6]);
 		ui16_torque_sensor_linear_values[7] = ui8_rx_buffer [8];
 		m_configuration_variables.ui8_hall_ref_angles[3] = ui8_rx_buffer[9];
@@ -1541,6 +3198,7 @@ static void uart_receive_package(void)
 
         case 4:
           
+        ui8_torque_sensor_linear_update = 1;
         ui16_torque_sensor_linear_values[8] = (((uint16_t) ui8_rx_buffer [7]) << 8) + ((uint16_t) ui8_rx_buffer [6]);
 		ui16_torque_sensor_linear_values[9] = ui8_rx_buffer [8];
 		m_configuration_variables.ui8_hall_ref_angles[4] = ui8_rx_buffer[9];
@@ -1550,6 +3208,7 @@ static void uart_receive_package(void)
 
         case 5:
 		
+        ui8_torque_sensor_linear_update = 1;
         ui16_torque_sensor_linear_values[10] = (((uint16_t) ui8_rx_buffer [7]) << 8) + ((uint16_t) ui8_rx_buffer [6]);
 		ui16_torque_sensor_linear_values[11] = ui8_rx_buffer [8];
         m_configuration_variables.ui8_hall_ref_angles[5] = ui8_rx_buffer[9];
@@ -1564,8 +3223,8 @@ static void uart_receive_package(void)
 		// battery low voltage cut off x10
 		m_configuration_variables.ui16_battery_low_voltage_cut_off_x10 = (((uint16_t) ui8_rx_buffer[9]) << 8) + ((uint16_t) ui8_rx_buffer[8]);
 		
-		// set low voltage cutoff (8 bit)
-        ui16_adc_voltage_cut_off = ((uint32_t) m_configuration_variables.ui16_battery_low_voltage_cut_off_x10 * 25U) / BATTERY_VOLTAGE_PER_10_BIT_ADC_STEP_X1000;
+		// set low voltage cutoff (10 bit)
+        ui16_adc_voltage_cut_off = ((uint32_t) m_configuration_variables.ui16_battery_low_voltage_cut_off_x10 * 100U) / BATTERY_VOLTAGE_PER_10_BIT_ADC_STEP_X1000;
         
 		// type of motor (36 volt, 48 volt or some experimental type)
         m_configuration_variables.ui8_motor_type = ui8_rx_buffer[10];
@@ -1573,14 +3232,16 @@ static void uart_receive_package(void)
 		  if(m_configuration_variables.ui8_motor_type == 0)
 		  {
 			// 48 V motor
-			i16_cruise_pid_kp = 12;
-			i16_cruise_pid_ki = 1;
+			ui16_cruise_pid_kp_x256 = CRUISE_PID_KP_X256_48V_MOTOR;
+			ui16_cruise_pid_ki_x256 = CRUISE_PID_KI_X256_48V_MOTOR;
+			ui16_motor_phase_current_per_torque_x100_q16 = (uint16_t)(65536UL / MOTOR_TORQUE_X100_PER_PHASE_ADC_STEP_48V_MOTOR);
 		  }
 		  else
 		  {
 			// 36 V motor
-			i16_cruise_pid_kp = 14;
-			i16_cruise_pid_ki = 0.7;
+			ui16_cruise_pid_kp_x256 = CRUISE_PID_KP_X256_36V_MOTOR;
+			ui16_cruise_pid_ki_x256 = CRUISE_PID_KI_X256_36V_MOTOR;
+			ui16_motor_phase_current_per_torque_x100_q16 = (uint16_t)(65536UL / MOTOR_TORQUE_X100_PER_PHASE_ADC_STEP_36V_MOTOR);
 		  }
 		
 		break;
@@ -1589,6 +3250,7 @@ static void uart_receive_package(void)
 		
 		  // wheel perimeter
           m_configuration_variables.ui16_wheel_perimeter = (((uint16_t) ui8_rx_buffer [7]) << 8) + ((uint16_t) ui8_rx_buffer [6]);
+          ui32_wheel_speed_sensor_x10_times_ticks = ((uint32_t) m_configuration_variables.ui16_wheel_perimeter * WHEEL_SPEED_SENSOR_SPEED_X10_TIMES_TICKS) / ui8_wheel_speed_sensor_magnets;
 		
     	  // pedal torque conversion
           m_configuration_variables.ui8_pedal_torque_per_10_bit_ADC_step_x100 = ui8_rx_buffer[8];
@@ -1616,7 +3278,228 @@ static void uart_receive_package(void)
           if (ui8_assist_without_pedal_rotation_threshold > 100) { ui8_assist_without_pedal_rotation_threshold = 0; }
 
          break;
-		
+
+        case 9:
+
+          // motor winding thermal resistance to ambient, K/W x1000
+          m_thermal_winding.ui16_thermal_resistance_x1000 = (((uint16_t) ui8_rx_buffer [7]) << 8) + ((uint16_t) ui8_rx_buffer [6]);
+
+          // motor winding thermal time constant, x10 seconds
+          m_thermal_winding.ui16_time_constant = (uint16_t) ui8_rx_buffer[8] * 10;
+
+          // motor winding max temperature
+          m_thermal_winding.ui8_temperature_max = ui8_rx_buffer[9];
+
+          // ambient temperature
+          ui8_thermal_ambient_temperature = ui8_rx_buffer[10];
+
+          // check if values are valid (safety)
+          if (!m_thermal_winding.ui16_thermal_resistance_x1000) { m_thermal_winding.ui16_thermal_resistance_x1000 = 1; }
+          if (!m_thermal_winding.ui16_time_constant) { m_thermal_winding.ui16_time_constant = 1; }
+          if (m_thermal_winding.ui8_temperature_max < THERMAL_MODEL_DERATING_RANGE) { m_thermal_winding.ui8_temperature_max = THERMAL_MODEL_DERATING_RANGE; }
+
+        break;
+
+        case 10:
+
+          // MOSFETs thermal resistance to ambient, K/W x1000
+          m_thermal_mosfets.ui16_thermal_resistance_x1000 = (((uint16_t) ui8_rx_buffer [7]) << 8) + ((uint16_t) ui8_rx_buffer [6]);
+
+          // MOSFETs thermal time constant, seconds
+          m_thermal_mosfets.ui16_time_constant = ui8_rx_buffer[8];
+
+          // MOSFETs max temperature
+          m_thermal_mosfets.ui8_temperature_max = ui8_rx_buffer[9];
+
+          // thermal model derating
+          ui8_thermal_model_enabled = ui8_rx_buffer[10];
+
+          // check if values are valid (safety)
+          if (!m_thermal_mosfets.ui16_thermal_resistance_x1000) { m_thermal_mosfets.ui16_thermal_resistance_x1000 = 1; }
+          if (!m_thermal_mosfets.ui16_time_constant) { m_thermal_mosfets.ui16_time_constant = 1; }
+          if (m_thermal_mosfets.ui8_temperature_max < THERMAL_MODEL_DERATING_RANGE) { m_thermal_mosfets.ui8_temperature_max = THERMAL_MODEL_DERATING_RANGE; }
+
+        break;
+
+        case 11:
+
+          // battery voltage limiting
+          ui8_battery_voltage_limiting_enabled = ui8_rx_buffer[6];
+
+          // voltage margin over cut off voltage x10, in ADC steps
+          ui8_adc_battery_voltage_margin = ((uint16_t) ui8_rx_buffer[7] * 100U) / BATTERY_VOLTAGE_PER_10_BIT_ADC_STEP_X1000;
+
+          // initial battery internal resistance in mOhm, until estimated
+          uint16_t ui16_battery_resistance_mohm = (((uint16_t) ui8_rx_buffer [9]) << 8) + ((uint16_t) ui8_rx_buffer [8]);
+          if (ui16_battery_resistance_mohm) { ui16_battery_resistance_x4096 = ((uint32_t) ui16_battery_resistance_mohm * 4096U) / 544U; }
+
+        break;
+
+        case 12:
+
+          // torque sensor linearization points after the first 6, sent in order
+          {
+            uint8_t ui8_point = ui8_rx_buffer[6];
+
+            if ((ui8_point >= TORQUE_SENSOR_LINEARIZE_NR_POINTS_DEFAULT) && (ui8_point < TORQUE_SENSOR_LINEARIZE_NR_POINTS)) {
+              ui16_torque_sensor_linear_values[ui8_point << 1] = (((uint16_t) ui8_rx_buffer [8]) << 8) + ((uint16_t) ui8_rx_buffer [7]);
+              ui16_torque_sensor_linear_values[(ui8_point << 1) + 1] = (((uint16_t) ui8_rx_buffer [10]) << 8) + ((uint16_t) ui8_rx_buffer [9]);
+              ui8_torque_sensor_linear_nr_points = ui8_max(ui8_torque_sensor_linear_nr_points, ui8_point + 1);
+              ui8_torque_sensor_linear_update = 1;
+            }
+          }
+
+        break;
+
+        case 13:
+
+          // wheel speed sensor number of magnets
+          {
+            uint8_t ui8_magnets = ui8_rx_buffer[6];
+
+            // check if value is valid
+            if ((ui8_magnets == 0) || (ui8_magnets > WHEEL_SPEED_SENSOR_MAGNETS_MAX)) { ui8_magnets = 1; }
+
+            disableInterrupts();
+            ui8_wheel_speed_sensor_magnets = ui8_magnets;
+            ui16_wheel_speed_sensor_interval_min = WHEEL_SPEED_SENSOR_INTERVAL_MIN / ui8_magnets;
+            enableInterrupts();
+            
+            ui32_wheel_speed_sensor_x10_times_ticks = ((uint32_t) m_configuration_variables.ui16_wheel_perimeter * WHEEL_SPEED_SENSOR_SPEED_X10_TIMES_TICKS) / ui8_magnets;
+          }
+
+        break;
+
+        case 14:
+
+          // throttle deadband, % of the range
+          ui16_throttle_deadband = ((uint16_t) ui8_min(ui8_rx_buffer[6], 50) << 10) / 100;
+
+          // throttle expo %, over 100 uses the received curve
+          ui8_throttle_expo = ui8_rx_buffer[7];
+
+          // throttle current rise rate, A/s, 0 is no limit
+          ui16_throttle_current_rate_x256 = (uint16_t) ui8_rx_buffer[8] * THROTTLE_CURRENT_RATE_X256_PER_A_S;
+
+          // throttle response curve, received point or expo
+          {
+            uint8_t ui8_point = ui8_rx_buffer[9];
+            uint32_t ui32_x;
+
+            if (ui8_throttle_expo > 100) {
+              if ((ui8_point > 0) && (ui8_point < (THROTTLE_CURVE_NR_POINTS - 1))) {
+                ui16_throttle_curve[ui8_point] = (uint16_t) ui8_rx_buffer[10] << 2;
+              }
+            } else {
+              // y = x * (1 - expo) + x^3 * expo
+              for (ui8_point = 1; ui8_point < (THROTTLE_CURVE_NR_POINTS - 1); ui8_point++) {
+                ui32_x = (uint32_t) ui8_point << 7;
+                ui16_throttle_curve[ui8_point] = (uint16_t) (((ui32_x * (100 - ui8_throttle_expo)) +
+                    ((((ui32_x * ui32_x) >> 10) * ui32_x) >> 10) * ui8_throttle_expo) / 100);
+              }
+            }
+          }
+
+        break;
+
+        case 15:
+
+          // coaster brake torque threshold under the pedal torque offset, ADC steps, 0 = disabled
+          ui8_coaster_brake_torque_threshold = ui8_rx_buffer[6];
+
+        break;
+
+        case 16:
+
+          // ADC filters, IIR filter coefficient as shift of the decimated samples
+          disableInterrupts();
+          ui8_adc_voltage_filter_shift = ui8_min(ui8_rx_buffer[6], ADC_FILTER_IIR_SHIFT_MAX);
+          ui8_adc_throttle_filter_shift = ui8_min(ui8_rx_buffer[7], ADC_FILTER_IIR_SHIFT_MAX);
+          enableInterrupts();
+
+        break;
+
+        case 17:
+
+          // assist curve point, [6] curve index x16 + point index, [7] [8] x, [9] [10] y
+          {
+            uint8_t ui8_curve = ui8_rx_buffer[6] >> 4;
+            uint8_t ui8_point = ui8_rx_buffer[6] & 0x0F;
+            
+            /*------------------------------------------------------------------------
+            
+              NOTE: regarding the assist curve upload
+              
+              Point index 15 sets the number of points from [7], less than 2
+              points disables the curve. To replace a curve in use first set 
+              the number of points to 0, then send the points with rising x 
+              and at last the number of points.
+              
+              The curve is saved to EEPROM with the motor stopped, only
+              the changed bytes are written.
+              
+            ------------------------------------------------------------------------*/
+            
+            if (ui8_curve < ASSIST_CURVES_NR) {
+              if (ui8_point == ASSIST_CURVE_POINT_SET_NR_POINTS) {
+                m_assist_curves[ui8_curve].ui8_nr_points = ui8_min(ui8_rx_buffer[7], CURVE_NR_POINTS_MAX);
+                ui8_assist_curves_save |= (uint8_t) (1 << ui8_curve);
+              } else if (ui8_point < CURVE_NR_POINTS_MAX) {
+                m_assist_curves[ui8_curve].ui16_x[ui8_point] = (((uint16_t) ui8_rx_buffer[8]) << 8) + ((uint16_t) ui8_rx_buffer[7]);
+                m_assist_curves[ui8_curve].ui16_y[ui8_point] = (((uint16_t) ui8_rx_buffer[10]) << 8) + ((uint16_t) ui8_rx_buffer[9]);
+                ui8_assist_curves_save |= (uint8_t) (1 << ui8_curve);
+              }
+            }
+          }
+
+        break;
+
+        case 18:
+
+          // gear shift detection: [6] enabled, [7] current during the shift %, [8] hold time x10ms, [9] ramp time x10ms
+          ui8_gear_shift_detection_enabled = ui8_rx_buffer[6];
+          ui8_gear_shift_current_x256 = (uint8_t) (((uint16_t) ui8_min(ui8_rx_buffer[7], 99) << 8) / 100);
+          ui8_gear_shift_hold_cycles = (uint8_t) ui8_min(ui8_rx_buffer[8], 127) << 1;
+          {
+            uint16_t ui16_ramp_cycles = (uint16_t) ui8_rx_buffer[9] << 1;
+            ui8_gear_shift_ramp_step_x256 = ui16_ramp_cycles ? (uint8_t) ui8_max((uint8_t) ((256U - ui8_gear_shift_current_x256) / ui16_ramp_cycles), 1) : 255;
+          }
+
+        break;
+
+        case 19:
+
+          // motor acceleration bins range: [6] wheel speed min km/h, [7] wheel speed max km/h, [8] cadence min RPM, [9] cadence max RPM
+          if ((ui8_rx_buffer[7] > ui8_rx_buffer[6]) && (ui8_rx_buffer[9] >= (uint16_t) ui8_rx_buffer[8] + RAMP_TABLE_BINS) &&
+              (((uint16_t) ui8_rx_buffer[6] * 10U != ui16_ramp_speed_min_x10) || ((uint16_t) ui8_rx_buffer[7] * 10U != ui16_ramp_speed_max_x10) ||
+               (ui8_rx_buffer[8] != ui8_ramp_cadence_min) || (ui8_rx_buffer[9] != ui8_ramp_cadence_max))) {
+            ui16_ramp_speed_min_x10 = (uint16_t) ui8_rx_buffer[6] * 10U;
+            ui16_ramp_speed_max_x10 = (uint16_t) ui8_rx_buffer[7] * 10U;
+            ui8_ramp_cadence_min = ui8_rx_buffer[8];
+            ui8_ramp_cadence_max = ui8_rx_buffer[9];
+            calc_ramp_tables();
+          }
+
+        break;
+
+        case 20:
+
+          // road load estimation: [6] mass of rider, bike and load in kg, [7] assist % more for each 1 % of grade (0 = disabled), [8] assist % more max
+          if (ui8_rx_buffer[6] >= ROAD_LOAD_MASS_KG_MIN) { ui8_road_load_mass_kg = ui8_rx_buffer[6]; }
+          ui8_road_load_assist_boost = ui8_rx_buffer[7];
+          ui8_road_load_assist_boost_max = ui8_rx_buffer[8];
+
+        break;
+
+        case 21:
+
+          // launch profile: [6] crank revolutions (0 = not used), [7] time x0.1 s (0 = not used), [8] soft start levels held for % of the launch
+          set_launch_profile(ui8_rx_buffer[6], ui8_rx_buffer[7]);
+          ui8_launch_hold_x256 = (uint8_t) (((uint16_t) ui8_min(ui8_rx_buffer[8], 99) << 8) / 100);
+          ui16_launch_fade_x256 = (uint16_t) (65536UL / (256U - ui8_launch_hold_x256));
+
+        break;
+
 		default:
           // nothing, should display error code
         break;
@@ -1655,7 +3538,7 @@ static void uart_send_package(void)
   ui8_tx_buffer[6] = ui8_brake_state;
 
   // optional ADC channel value
-  ui8_tx_buffer[7] = (uint8_t)(ui16_adc_throttle >> 2);
+  ui8_tx_buffer[7] = (uint8_t)(ui16_adc_throttle_filtered >> 2);
   
   // throttle or temperature control
   switch (m_configuration_variables.ui8_optional_ADC_function)
@@ -1696,6 +3579,15 @@ static void uart_send_package(void)
         ui16_temp = ui16_hall_calib_cnt[5];
         ui8_tx_buffer[20] = (uint8_t) (ui16_temp & 0xff);
         ui8_tx_buffer[21] = (uint8_t) (ui16_temp >> 8);
+   } else if (ui8_packet_type == UART_PACKET_STATISTICS) {
+        // ride statistics page: page number, 5 words, number of pages
+        ui8_tx_buffer[10] = ui8_ride_statistics_page;
+        for (ui8_i = 0; ui8_i < RIDE_STATISTICS_WORDS_PER_PAGE; ui8_i++) {
+          ui16_temp = get_ride_statistics_word((uint8_t)((ui8_ride_statistics_page * RIDE_STATISTICS_WORDS_PER_PAGE) + ui8_i));
+          ui8_tx_buffer[11 + (ui8_i << 1)] = (uint8_t) (ui16_temp & 0xff);
+          ui8_tx_buffer[12 + (ui8_i << 1)] = (uint8_t) (ui16_temp >> 8);
+        }
+        ui8_tx_buffer[21] = RIDE_STATISTICS_NR_PAGES;
    } else {  
    // ADC torque sensor
   ui16_temp = ui16_adc_pedal_torque;
@@ -1717,8 +3609,9 @@ static void uart_send_package(void)
   // FOC angle
   ui8_tx_buffer[15] = ui8_g_foc_angle;
   
-  // system state
-  ui8_tx_buffer[16] = ui8_system_state;
+  // system state, wheel speed sensor fault is only a warning
+  if ((ui8_system_state == NO_ERROR) && (ui8_wheel_speed_sensor_fault)) { ui8_tx_buffer[16] = ERROR_NO_SPEED_SENSOR_DETECTED; }
+  else { ui8_tx_buffer[16] = ui8_system_state; }
   
   // wheel_speed_sensor_tick_counter
   ui8_tx_buffer[17] = (uint8_t) (ui32_wheel_speed_sensor_ticks_total & 0xff);
@@ -1729,7 +3622,51 @@ static void uart_send_package(void)
   ui16_temp = ui16_pedal_torque_x100;
   ui8_tx_buffer[20] = (uint8_t) (ui16_temp & 0xff);
   ui8_tx_buffer[21] = (uint8_t) (ui16_temp >> 8);
-  } 
+  }
+
+  // motor winding and MOSFETs estimated temperature
+  ui8_tx_buffer[22] = m_thermal_winding.ui8_temperature;
+  ui8_tx_buffer[23] = m_thermal_mosfets.ui8_temperature;
+
+  // battery internal resistance in mOhm
+  ui16_temp = ((uint32_t) ui16_battery_resistance_x4096 * 17U) >> 7;
+  ui8_tx_buffer[24] = (uint8_t) (ui16_temp & 0xff);
+  ui8_tx_buffer[25] = (uint8_t) (ui16_temp >> 8);
+
+  // battery open circuit voltage x1000
+  ui16_temp = ((uint32_t) ui16_battery_open_circuit_voltage_x64 * BATTERY_VOLTAGE_PER_10_BIT_ADC_STEP_X1000) >> 6;
+  ui8_tx_buffer[26] = (uint8_t) (ui16_temp & 0xff);
+  ui8_tx_buffer[27] = (uint8_t) (ui16_temp >> 8);
+
+  // battery charge consumed in mAh x10
+  ui8_tx_buffer[28] = (uint8_t) (ui32_battery_charge_consumed_x10 & 0xff);
+  ui8_tx_buffer[29] = (uint8_t) (ui32_battery_charge_consumed_x10 >> 8);
+  ui8_tx_buffer[30] = (uint8_t) (ui32_battery_charge_consumed_x10 >> 16);
+  ui8_tx_buffer[31] = (uint8_t) (ui32_battery_charge_consumed_x10 >> 24);
+
+  // battery energy consumed in Wh x100
+  ui8_tx_buffer[32] = (uint8_t) (ui32_battery_energy_consumed_x100 & 0xff);
+  ui8_tx_buffer[33] = (uint8_t) (ui32_battery_energy_consumed_x100 >> 8);
+  ui8_tx_buffer[34] = (uint8_t) (ui32_battery_energy_consumed_x100 >> 16);
+  ui8_tx_buffer[35] = (uint8_t) (ui32_battery_energy_consumed_x100 >> 24);
+
+  // human power in W, averaged over one crank revolution
+  ui8_tx_buffer[36] = (uint8_t) (ui16_human_power & 0xff);
+  ui8_tx_buffer[37] = (uint8_t) (ui16_human_power >> 8);
+
+  // leg balance in %
+  ui8_tx_buffer[38] = ui8_leg_balance;
+
+  // detected gear shifts, counter wraps
+  ui8_tx_buffer[39] = ui8_gear_shift_counter;
+
+  // estimated grade in % x10, signed
+  ui8_tx_buffer[40] = (uint8_t) ((uint16_t) i16_road_grade_x10 & 0xff);
+  ui8_tx_buffer[41] = (uint8_t) ((uint16_t) i16_road_grade_x10 >> 8);
+
+  // estimated road load in N x10
+  ui8_tx_buffer[42] = (uint8_t) (ui16_road_load_force_x10 & 0xff);
+  ui8_tx_buffer[43] = (uint8_t) (ui16_road_load_force_x10 >> 8);
 
   // prepare crc of the package
   ui16_crc_tx = 0xffff;
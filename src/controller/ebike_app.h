@@ -12,8 +12,6 @@
 #include <stdint.h>
 #include "main.h"
 
-// cadence sensor
-extern uint16_t ui16_cadence_ticks_count_min_speed_adj;
 
 // Torque sensor coaster brake engaged threshold value
 extern uint16_t ui16_adc_pedal_torque_offset;
@@ -31,6 +29,8 @@ typedef struct _configuration_variables {
 } struct_configuration_variables;
 
 void ebike_app_controller(void);
+void ebike_app_fast_controller(void);
+void ebike_app_init(void);
 struct_configuration_variables* get_configuration_variables(void);
 
 #endif /* _EBIKE_APP_H_ */
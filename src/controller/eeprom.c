@@ -0,0 +1,68 @@
+/*
+ * TongSheng TSDZ2 motor controller firmware/
+ *
+ * Copyright (C) Casainho, 2018.
+ *
+ * Released under the GPL License, Version 3
+ */
+
+#include <stdint.h>
+#include "stm8s.h"
+#include "stm8s_flash.h"
+#include "main.h"
+#include "eeprom.h"
+
+void eeprom_init(void) {
+    uint8_t ui8_i;
+
+    // if the key is not there the EEPROM was never written by this firmware, so clear all the used bytes
+    if (FLASH_ReadByte(FLASH_DATA_START_PHYSICAL_ADDRESS + ADDRESS_KEY) != EEPROM_KEY) {
+        for (ui8_i = 0; ui8_i < EEPROM_BYTES_USED; ui8_i++) {
+            eeprom_write_byte(ui8_i, 0);
+        }
+        eeprom_write_byte(ADDRESS_KEY, EEPROM_KEY);
+    }
+}
+
+uint16_t eeprom_read_uint16(uint8_t ui8_address) {
+    // little endian
+    return ((uint16_t) eeprom_read_byte(ui8_address + 1) << 8) + eeprom_read_byte(ui8_address);
+}
+
+uint32_t eeprom_read_uint32(uint8_t ui8_address) {
+    uint32_t ui32_value = 0;
+    uint8_t ui8_i;
+
+    // little endian
+    for (ui8_i = 4; ui8_i > 0; ui8_i--) {
+        ui32_value = (ui32_value << 8) + FLASH_ReadByte(FLASH_DATA_START_PHYSICAL_ADDRESS + ui8_address + ui8_i - 1);
+    }
+
+    return ui32_value;
+}
+
+void eeprom_write_uint32(uint8_t ui8_address, uint32_t ui32_value) {
+    uint8_t ui8_i;
+
+    // little endian
+    for (ui8_i = 0; ui8_i < 4; ui8_i++) {
+        eeprom_write_byte(ui8_address + ui8_i, (uint8_t) ui32_value);
+        ui32_value >>= 8;
+    }
+}
+
+uint8_t eeprom_read_byte(uint8_t ui8_address) {
+    return FLASH_ReadByte(FLASH_DATA_START_PHYSICAL_ADDRESS + ui8_address);
+}
+
+void eeprom_write_byte(uint8_t ui8_address, uint8_t ui8_value) {
+    uint32_t ui32_address = FLASH_DATA_START_PHYSICAL_ADDRESS + ui8_address;
+
+    // only write when the value changes, each write takes some milliseconds and wears the EEPROM
+    if (FLASH_ReadByte(ui32_address) != ui8_value) {
+        FLASH_Unlock(FLASH_MEMTYPE_DATA);
+        FLASH_ProgramByte(ui32_address, ui8_value);
+        FLASH_WaitForLastOperation(FLASH_MEMTYPE_DATA);
+        FLASH_Lock(FLASH_MEMTYPE_DATA);
+    }
+}
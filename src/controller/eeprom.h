@@ -0,0 +1,31 @@
+/*
+ * TongSheng TSDZ2 motor controller firmware/
+ *
+ * Copyright (C) Casainho, 2018.
+ *
+ * Released under the GPL License, Version 3
+ */
+
+#ifndef _EEPROM_H_
+#define _EEPROM_H_
+
+#include "main.h"
+
+// data EEPROM layout, offsets from the start of the data EEPROM
+#define EEPROM_KEY                                0xCA
+#define ADDRESS_KEY                               0
+#define ADDRESS_BATTERY_CHARGE_CONSUMED_X10       4   // uint32, mAh x10
+#define ADDRESS_BATTERY_ENERGY_CONSUMED_X100      8   // uint32, Wh x100
+#define ADDRESS_ASSIST_CURVES                     12  // for each curve: uint8 number of points, then uint16 x and y of each point
+#define ASSIST_CURVES_NR                          4
+#define ASSIST_CURVE_EEPROM_SIZE                  33  // 1 + (8 points * 4)
+#define EEPROM_BYTES_USED                         (ADDRESS_ASSIST_CURVES + (ASSIST_CURVES_NR * ASSIST_CURVE_EEPROM_SIZE))
+
+void eeprom_init(void);
+uint8_t eeprom_read_byte(uint8_t ui8_address);
+void eeprom_write_byte(uint8_t ui8_address, uint8_t ui8_value);
+uint16_t eeprom_read_uint16(uint8_t ui8_address);
+uint32_t eeprom_read_uint32(uint8_t ui8_address);
+void eeprom_write_uint32(uint8_t ui8_address, uint32_t ui32_value);
+
+#endif /* _EEPROM_H_ */
@@ -12,7 +12,9 @@
 #define EXTI_HALL_A_IRQ  7              // ITC_IRQ_PORTE - Hall sensor A rise/fall detection
 #define EXTI_HALL_B_IRQ  6              // ITC_IRQ_PORTD - Hall sensor B rise/fall detection
 #define EXTI_HALL_C_IRQ  5              // ITC_IRQ_PORTC - Hall sensor C rise/fall detection
+#define EXTI_WHEEL_SPEED_SENSOR_IRQ  3  // ITC_IRQ_PORTA - Wheel speed sensor rise detection
 #define TIM1_CAP_COM_IRQHANDLER 12      // ITC_IRQ_TIM1_CAPCOM - PWM control loop (52us)
+#define TIM3_OVF_IRQHANDLER 15          // ITC_IRQ_TIM3_OVF - TIM 3 overflow: Hall and wheel speed sensor time counter
 #define TIM4_OVF_IRQHANDLER 23          // ITC_IRQ_TIM4_OVF - TIM 4 overflow: 1ms counter
 #define UART2_TX_IRQHANDLER 20          // ITC_IRQ_UART2_TX - UART Data sent
 #define UART2_RX_IRQHANDLER 21          // ITC_IRQ_UART2_RX - UART Data received
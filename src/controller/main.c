@@ -22,6 +22,7 @@
 #include "ebike_app.h"
 #include "torque_sensor.h"
 #include "lights.h"
+#include "eeprom.h"
 
 /////////////////////////////////////////////////////////////////////////////////////////////
 //// Functions prototypes
@@ -57,6 +58,10 @@ void UART2_RX_IRQHandler(void) __interrupt(UART2_RX_IRQHANDLER);
 void UART2_TX_IRQHandler(void) __interrupt(UART2_TX_IRQHANDLER);
 // TIM4 Overflow interrupt (called every 1ms)
 void TIM4_IRQHandler(void) __interrupt(TIM4_OVF_IRQHANDLER);
+// TIM3 Overflow interrupt (called every 262ms)
+void TIM3_IRQHandler(void) __interrupt(TIM3_OVF_IRQHANDLER);
+// Wheel speed sensor signal interrupt
+void WHEEL_SPEED_SENSOR_PORT_IRQHandler(void) __interrupt(EXTI_WHEEL_SPEED_SENSOR_IRQ);
 // Hall Sensor Signal interrupt
 void HALL_SENSOR_A_PORT_IRQHandler(void) __interrupt(EXTI_HALL_A_IRQ);
 void HALL_SENSOR_B_PORT_IRQHandler(void) __interrupt(EXTI_HALL_B_IRQ);
@@ -70,6 +75,10 @@ void HALL_SENSOR_C_PORT_IRQHandler(void) __interrupt(EXTI_HALL_C_IRQ);
 static uint8_t ui8_1ms_counter = 0;
 static uint8_t ui8_ebike_app_controller_counter = 0;
 static uint8_t ui8_motor_controller_counter = 0;
+#ifdef MAIN_TIME_DEBUG
+// max ebike_app_controller() duration in TIM3 ticks (4us), read it with the debugger
+volatile uint16_t ui16_ebike_app_controller_ticks_max = 0;
+#endif
 
 int main(void) {
     // set clock at the max 16 MHz
@@ -87,6 +96,8 @@ int main(void) {
     wheel_speed_sensor_init();
     pwm_init();
     hall_sensor_init();
+    eeprom_init();
+    ebike_app_init();
     enableInterrupts();
 
     while (1) {
@@ -97,16 +108,29 @@ int main(void) {
 
             ui8_motor_controller_counter = ui8_1ms_counter;
             motor_controller();
+            ebike_app_fast_controller();
 
             continue;
         }
 
-        // run every 25ms. Max measured ebike_app_controller() duration is 3,1 ms.
+        // run every 25ms. Max measured ebike_app_controller() duration was 3,1 ms before the
+        // fixed point divisions, measure it again with MAIN_TIME_DEBUG.
         if ((uint8_t)(ui8_1ms_counter - ui8_ebike_app_controller_counter) >= 25U) {
+#ifdef MAIN_TIME_DEBUG
+            uint16_t ui16_time_start;
+            uint16_t ui16_time_ticks;
 
+            ui16_time_start = (uint16_t)TIM3->CNTRH << 8;
+            ui16_time_start |= TIM3->CNTRL;
+#endif
             ui8_ebike_app_controller_counter = ui8_1ms_counter;
             ebike_app_controller();
-
+#ifdef MAIN_TIME_DEBUG
+            ui16_time_ticks = (uint16_t)TIM3->CNTRH << 8;
+            ui16_time_ticks |= TIM3->CNTRL;
+            ui16_time_ticks -= ui16_time_start;
+            if (ui16_time_ticks > ui16_ebike_app_controller_ticks_max) { ui16_ebike_app_controller_ticks_max = ui16_time_ticks; }
+#endif
         }
     }
 }
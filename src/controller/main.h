@@ -53,6 +53,7 @@
 #define PWM_DUTY_CYCLE_RAMP_UP_INVERSE_STEP_MIN                 (uint8_t)(PWM_CYCLES_SECOND/781)     // 20 -> 20 * 64 us for every duty cycle increment at 15.625KHz
 #define PWM_DUTY_CYCLE_RAMP_DOWN_INVERSE_STEP_DEFAULT           (uint8_t)(PWM_CYCLES_SECOND/390)     // 40 -> 40 * 64 us for every duty cycle decrement at 15.625KHz
 #define PWM_DUTY_CYCLE_RAMP_DOWN_INVERSE_STEP_MIN               (uint8_t)(PWM_CYCLES_SECOND/1953)      // 8 -> 8 * 64 us for every duty cycle decrement at 15.625KHz
+#define BRAKE_RELEASE_DEBOUNCE_CYCLES                           (uint8_t)(PWM_CYCLES_SECOND/100)       // 10ms, brake is set immediately and released after this time
 #define CRUISE_DUTY_CYCLE_RAMP_UP_INVERSE_STEP                  (uint8_t)(PWM_CYCLES_SECOND/195)     // 80 at 15.625KHz
 #define WALK_ASSIST_DUTY_CYCLE_RAMP_UP_INVERSE_STEP             (uint8_t)(PWM_CYCLES_SECOND/78)    // 200 at 15.625KHz
 #define THROTTLE_DUTY_CYCLE_RAMP_UP_INVERSE_STEP_DEFAULT        (uint8_t)(PWM_CYCLES_SECOND/195)     // 80 at 15.625KHz
@@ -60,15 +61,82 @@
 
 #define MOTOR_OVER_SPEED_ERPS                                   ((PWM_CYCLES_SECOND/29) < 650 ?  (PWM_CYCLES_SECOND/29) : 650) // motor max speed | 29 points for the sinewave at max speed (less than PWM_CYCLES_SECOND/29)
 
-// cadence
-#define CADENCE_SENSOR_CALC_COUNTER_MIN                         (uint16_t)((uint32_t)PWM_CYCLES_SECOND*100U/446U)  // 3500 at 15.625KHz
-#define CADENCE_SENSOR_TICKS_COUNTER_MIN_AT_SPEED               (uint16_t)((uint32_t)PWM_CYCLES_SECOND*10U/558U)   // 280 at 15.625KHz
-#define CADENCE_TICKS_STARTUP                                   (uint16_t)((uint32_t)PWM_CYCLES_SECOND*10U/25U)  // ui16_cadence_sensor_ticks value for startup. About 7-8 RPM (6250 at 15.625KHz)
-#define CADENCE_SENSOR_STANDARD_MODE_SCHMITT_TRIGGER_THRESHOLD  (uint16_t)((uint32_t)PWM_CYCLES_SECOND*10U/446U)   // software based Schmitt trigger to stop motor jitter when at resolution limits (350 at 15.625KHz)
+// cadence (PAS transitions are timestamped with TIM3, same clock as HALL_COUNTER_FREQ)
+#define CADENCE_SENSOR_STOP_TIMEOUT_MAX                         (uint16_t)((uint32_t)HALL_COUNTER_FREQ*100U/446U)  // 224ms without transitions: pedal stop (56053)
+#define CADENCE_SENSOR_STOP_TIMEOUT_MIN_AT_SPEED                (uint16_t)((uint32_t)HALL_COUNTER_FREQ*10U/558U)   // 18ms at high wheel speed (4480)
+#define CADENCE_SENSOR_EDGES_BUFFER_SIZE                        8U      // transitions used to calculate the cadence, must be a power of 2
+#define CADENCE_SENSOR_RPM_X10_TIMES_TICKS                      ((uint32_t)HALL_COUNTER_FREQ*60U*10U/(CADENCE_SENSOR_NUMBER_MAGNETS*4U)) // RPM x10 * ticks between transitions (1875000)
 
-// Wheel speed sensor
-#define WHEEL_SPEED_SENSOR_TICKS_COUNTER_MAX                    (uint16_t)((uint32_t)PWM_CYCLES_SECOND*10U/1157U)   // (135 at 15,625KHz) something like 200 m/h with a 6'' wheel
-#define WHEEL_SPEED_SENSOR_TICKS_COUNTER_MIN                    (uint16_t)((uint32_t)PWM_CYCLES_SECOND*1000U/477U) // 32767@15625KHz could be a bigger number but will make for a slow detection of stopped wheel speed
+// ADC filter stage (PWM interrupt)
+#define ADC_FILTER_BOXCAR_SAMPLES                               16U     // must be a power of 2, 0.89ms
+#define ADC_FILTER_IIR_SHIFT_DEFAULT                            4       // 16 decimated samples: 14ms time constant
+#define ADC_FILTER_IIR_SHIFT_MAX                                6
+
+/*---------------------------------------------------------
+ NOTE: regarding the ADC filter stage
+
+ Battery voltage and throttle samples are summed over
+ ADC_FILTER_BOXCAR_SAMPLES PWM cycles, the sum (10 bit x16)
+ is the input of a first order IIR filter:
+ filtered += (sum - filtered) >> shift
+ Each channel is decimated in a different PWM cycle so the
+ interrupt does at most one IIR update. Torque sensor
+ samples are only accumulated, ebike_app decimates them.
+ ---------------------------------------------------------*/
+
+// Wheel speed sensor (transitions are timestamped with TIM3, same clock as HALL_COUNTER_FREQ)
+#define WHEEL_SPEED_SENSOR_INTERVAL_MIN                         (uint16_t)((uint32_t)HALL_COUNTER_FREQ*10U/1333U)  // 7.5ms, something like 200 km/h with a 6'' wheel (1875)
+#define WHEEL_SPEED_SENSOR_STOP_TIMEOUT                         ((uint32_t)HALL_COUNTER_FREQ*10U)                  // 10s without transitions: wheel stop
+#define WHEEL_SPEED_SENSOR_SPEED_MIN_X10                        20      // 2 km/h, lower extrapolated speed is a wheel stop
+#define WHEEL_SPEED_SENSOR_MAGNETS_MAX                          16U
+#define WHEEL_SPEED_SENSOR_SPEED_X10_TIMES_TICKS                ((uint32_t)HALL_COUNTER_FREQ*36U/1000U) // km/h x10 * ticks between transitions / wheel perimeter mm (9000)
+
+// speed fusion with motor speed, drivetrain ratio in km/h x10 per ERPS x256
+#define SPEED_FUSION_ERPS_MIN                                   30      // motor driving the wheel
+#define SPEED_FUSION_CURRENT_MIN_X10                            20      // 2.0 amps, over the motor no load current
+#define SPEED_FUSION_RATIO_DEFAULT_X256                         113     // 42/21 gear and 28'' wheel
+#define SPEED_FUSION_RATIO_MIN_X256                             32      // 0.125 km/h x10 per ERPS, lower than any gear
+#define SPEED_FUSION_RATIO_MAX_X256                             512     // 2.0 km/h x10 per ERPS, higher than any gear
+#define SPEED_FUSION_RATIO_FILTER                               3       // 1/8 of the new measured ratio
+#define SPEED_FUSION_TOLERANCE_SHIFT                            2       // 25%
+#define SPEED_SENSOR_FAULT_COUNTER_THRESHOLD                    200     // 200 * 25ms = 5 seconds
+
+// gear shift detection, every 5ms
+#define GEAR_SHIFT_FILTER_SHIFT                                 5       // 32 * 5ms = 160ms reference for the cadence jump
+#define GEAR_SHIFT_RATIO_JUMP_SHIFT                             3       // 12.5% motor speed to wheel speed ratio change
+#define GEAR_SHIFT_RATIO_HOLD_SHIFT                             4       // 6.25% change, reference held for one period (shift split over two periods)
+#define GEAR_SHIFT_RATIO_FILTER_SHIFT                           2       // reference follows 1/4 of each wheel speed sensor period ratio
+#define GEAR_SHIFT_RATIO_CYCLES_MIN                             4       // 20ms, shorter wheel speed sensor periods are skipped
+#define GEAR_SHIFT_CADENCE_JUMP_SHIFT                           2       // 25% cadence change
+#define GEAR_SHIFT_TORQUE_DROP_SHIFT                            2       // torque under 25% of the revolution average
+#define GEAR_SHIFT_ERPS_MIN                                     30
+#define GEAR_SHIFT_WHEEL_SPEED_MIN_X10                          50      // 5 km/h
+#define GEAR_SHIFT_CADENCE_MIN_X10                              200     // 20 RPM
+#define GEAR_SHIFT_CURRENT_X256_DEFAULT                         64      // 25% of the current target during the shift
+#define GEAR_SHIFT_HOLD_CYCLES_DEFAULT                          30      // 150ms
+#define GEAR_SHIFT_RAMP_STEP_X256_DEFAULT                       3       // back to full current in 64 * 5ms = 320ms
+
+/*---------------------------------------------------------
+ NOTE: regarding the gear shift detection
+
+ With the motor driving, a shift shows up as a jump of the
+ motor speed to wheel speed ratio while the chain moves to
+ the new sprocket, or as a cadence jump with a torque drop
+ when the rider eases off the pedals. Torque drop alone is
+ not used as it happens at every crank dead spot.
+
+ The ratio is checked once every wheel speed sensor period,
+ as motor electrical revolutions in the period:
+
+ ratio = ERPS averaged over the period * period (ticks)
+
+ Both are measured over the same time, so the ratio does
+ not change when accelerating, even with one magnet.
+
+ On detection the current target in the motor controller
+ is cut at once, held for the hold time and ramped back.
+ Detected shifts are counted in the telemetry.
+ ---------------------------------------------------------*/
 
 
 #define MIDDLE_SVM_TABLE                                          107
@@ -116,6 +184,15 @@ HALL_COUNTER_OFFSET_UP:    29 -> 44
 // Torque sensor values
 #define ADC_TORQUE_SENSOR_CALIBRATION_OFFSET    6
 
+// torque sensor excitation (TIM2, prescaler 2)
+// period must be an exact fraction of the PWM period so the ADC always samples the torque
+// sensor at the same excitation phase: 888 / 3 = 296 clock cycles = 18.5us, pulse of 2us
+#define TORQUE_SENSOR_EXCITATION_COUNTER_MAX    (((PWM_COUNTER_MAX * 2) / (2 * 3)) - 1)  // 147
+#define TORQUE_SENSOR_EXCITATION_PULSE          16
+// TIM2 counter value set from the PWM interrupt (TIM1 up counting at PWM_COUNTER_MAX/2), so the
+// torque ADC channel, sampled about 612 clock cycles later, is sampled at the end of the pulse
+#define TORQUE_SENSOR_EXCITATION_PHASE          34
+
 
 /*---------------------------------------------------------
  NOTE: regarding motor start interpolation
@@ -141,6 +218,13 @@ HALL_COUNTER_OFFSET_UP:    29 -> 44
 // throttle ADC values
 #define ADC_THROTTLE_MIN_VALUE                                    47
 #define ADC_THROTTLE_MAX_VALUE                                    176
+#define ADC_10_BIT_THROTTLE_MIN_VALUE_LIMIT                       102   // 0.5 V, lower values are a throttle fault
+#define ADC_10_BIT_THROTTLE_MIN_VALUE_STARTUP_MAX                 307   // 1.5 V, higher values at startup are not the released throttle
+#define ADC_10_BIT_THROTTLE_MAX_VALUE_LIMIT                       921   // 4.5 V
+#define ADC_10_BIT_THROTTLE_REST_MARGIN                           20    // 0.1 V over the learned released throttle, for noise and drift
+#define THROTTLE_LEARN_CYCLES                                     40    // 1 s at 25 ms, a new min or max must persist this long
+#define THROTTLE_CURVE_NR_POINTS                                  9     // curve points every 128 steps from 0 to 1024
+#define THROTTLE_CURRENT_RATE_X256_PER_A_S                        (uint16_t)(640U/BATTERY_CURRENT_PER_10_BIT_ADC_STEP_X100) // ADC steps x256 per 25ms cycle for 1 A/s
 
 /*---------------------------------------------------------
  NOTE: regarding throttle ADC values
@@ -148,6 +232,17 @@ HALL_COUNTER_OFFSET_UP:    29 -> 44
  Max voltage value for throttle, in ADC 8 bits step,
  each ADC 8 bits step = (5 V / 256) = 0.0195
 
+ ADC_THROTTLE_MIN_VALUE and ADC_THROTTLE_MAX_VALUE are only
+ the initial range, the 10 bit range is learned from the
+ released throttle at startup and from the lowest and
+ highest values after. The throttle starts only over the
+ learned minimum plus ADC_10_BIT_THROTTLE_REST_MARGIN.
+
+ A value out of the learned range is learned only after
+ it stays out for THROTTLE_LEARN_CYCLES cycles in a row,
+ and then the least extreme value of that time is taken,
+ so a single bad reading can not widen the range.
+
  ---------------------------------------------------------*/
 
 // cadence sensor
@@ -160,9 +255,10 @@ HALL_COUNTER_OFFSET_UP:    29 -> 44
  the cadence sensor. Was validated on August 2018 by Casainho and jbalat
 
  Cadence is calculated by counting how much time passes between two
- transitions. Depending on if all transitions are measured or simply
- transitions of the same kind it is important to adjust the calculation of
- pedal cadence.
+ transitions. All the 4 transitions of each magnet period (both edges of
+ PAS1 and PAS2) are measured, so one transition is 1/80 of revolution.
+ Transitions are not evenly spaced, only windows of 4 or 8 transitions
+ (1 or 2 magnet periods) give the exact cadence.
  -------------------------------------------------------------------------------*/
 
 
@@ -199,4 +295,126 @@ HALL_COUNTER_OFFSET_UP:    29 -> 44
 #define BATTERY_CURRENT_PER_10_BIT_ADC_STEP_X512                  80
 #define BATTERY_CURRENT_PER_10_BIT_ADC_STEP_X100                  16  // 0.16A x 10 bit ADC step
 
+// battery voltage reciprocal, current ADC steps per 0.01 W x2^22 = 2^22 / (100 * 0.087 * 0.16 * V)
+#define BATTERY_CURRENT_PER_POWER_X100_Q22_TIMES_ADC_VOLTAGE      (uint32_t)(4194304000UL / ((uint32_t)BATTERY_VOLTAGE_PER_10_BIT_ADC_STEP_X1000 * BATTERY_CURRENT_PER_10_BIT_ADC_STEP_X100))
+#define BATTERY_VOLTAGE_RECIPROCAL_ADC_MIN                        47  // 4.1 V, keeps the reciprocal under 65536
+
+// fixed point constants x65536 for divisions in the 25ms loop
+#define HUMAN_POWER_X100_PER_TORQUE_CADENCE_Q16                   683   // torque x100 * cadence x10 / 96
+#define HUMAN_POWER_PER_TORQUE_CADENCE_Q22                        439   // torque x100 * cadence x10 / 9550, x2^22
+#define DIVIDE_BY_10_Q16                                          6554  // exact up to 16388, 1 LSB over in x10 and x100 values over
+#define DIVIDE_BY_100_U16(x)                                      (uint16_t)((((uint32_t)(x) >> 2) * 5243U) >> 17)  // exact for all 16 bit values
+
+/*---------------------------------------------------------
+ NOTE: regarding divisions in the 25ms loop
+
+ SDCC calls _divulong / _divuint for every division, also
+ by constants, and they take much longer than the
+ multiplications. Divisions by constants are done as a
+ multiplication by the reciprocal x65536 with mul_u32_q16()
+ and the battery voltage reciprocal is calculated once
+ every cycle, so power to current needs no division:
+
+ I (ADC steps) = P x100 * reciprocal / 2^22
+
+ Only 32 bit divisions are replaced. A 16 bit division by
+ a constant is left as is, a reciprocal would need two
+ 32 bit multiplications and a function call.
+
+ A reciprocal is only used where its rounding error can
+ not change the result: x / 100 = ((x >> 2) * 5243) >> 17
+ is exact for every 16 bit x, 32 bit values that must be
+ exact keep the division.
+
+ Define MAIN_TIME_DEBUG to measure ebike_app_controller()
+ in TIM3 ticks (4us), see main.c.
+ ---------------------------------------------------------*/
+
+// battery internal resistance
+#define BATTERY_RESISTANCE_DEFAULT_MILLIOHM                       200
+#define BATTERY_RESISTANCE_DEFAULT_X4096                          (uint16_t)((uint32_t)BATTERY_RESISTANCE_DEFAULT_MILLIOHM * 4096U / 544U)
+
+/*---------------------------------------------------------
+ NOTE: regarding battery internal resistance
+
+ Resistance is estimated in voltage ADC steps per current
+ ADC step: 0.087 V / 0.16 A = 0.544 ohm per unit, x4096
+
+ R (mOhm) = R_x4096 * 544 / 4096 = R_x4096 * 17 / 128
+ ---------------------------------------------------------*/
+
+// thermal model losses
+#define WINDING_RESISTANCE_MILLIOHM_48V_MOTOR                     150 // equivalent phase resistance for copper losses
+#define WINDING_RESISTANCE_MILLIOHM_36V_MOTOR                     100
+#define WINDING_IRON_LOSSES_MW_PER_ERPS                           40  // 20 W at 500 ERPS
+#define MOSFETS_RESISTANCE_MILLIOHM                               10  // high side + low side conduction path
+#define MOSFETS_SWITCHING_LOSSES_MW_PER_ADC_STEP                  16  // about 0.1 W per phase amp at 18 kHz
+
+/*---------------------------------------------------------
+ NOTE: regarding the thermal model
+
+ Losses are calculated every second from the phase current
+ estimated in ADC steps (0.16 A), so the copper losses are:
+
+ P (mW) = I^2 * 0.0256 * R (mOhm) = I^2 * R / 39
+
+ Temperature rise of each node follows a first order model:
+
+ rise = rise + (P * Rth - rise) / tau
+ ---------------------------------------------------------*/
+
+// motor torque at the crank per phase current ADC step (0.16 A), Nm x100, including the gear losses
+#define MOTOR_TORQUE_X100_PER_PHASE_ADC_STEP_48V_MOTOR            69  // 4.3 Nm/A
+#define MOTOR_TORQUE_X100_PER_PHASE_ADC_STEP_36V_MOTOR            51  // 3.2 Nm/A
+
+/*---------------------------------------------------------
+ NOTE: regarding the motor torque assist
+
+ Motor torque is proportional to the phase current, so the
+ target is a phase current, converted to the battery current
+ target with the duty cycle each cycle:
+
+ I battery = I phase * duty cycle / PWM_DUTY_CYCLE_MAX
+
+ The same assist ratio gives the same motor torque at any
+ battery voltage and motor speed.
+ ---------------------------------------------------------*/
+
+// walk assist speed PI, gains x256 in duty cycle x256 per km/h x10
+#define WALK_ASSIST_PI_KP_X256                                    256 // 1 duty cycle step per 0.1 km/h
+#define WALK_ASSIST_PI_KI_X256                                    32
+#define WALK_ASSIST_SPEED_TARGET_RAMP_X256                        64  // soft start, 1 km/h per second
+#define WALK_ASSIST_STALL_ERPS_MAX                                5   // motor not turning
+#define WALK_ASSIST_STALL_DUTY_CYCLE_MIN                          40  // with this duty cycle or more
+#define WALK_ASSIST_STALL_CYCLES                                  40  // 40 * 25ms = 1 second
+
+// speed limit PI, gains x256 in battery current ADC steps x256 per km/h x10
+#define SPEED_LIMIT_PI_KP_X256                                    2560  // 10 ADC steps (1.6 A) per 0.1 km/h
+#define SPEED_LIMIT_PI_KI_X256                                    128   // 0.5 ADC steps per 0.1 km/h every 25ms
+#define SPEED_LIMIT_PI_ERROR_FULL_ASSIST_X10                      10    // no regulation more than 1 km/h under the limit
+
+// cruise PID, gains x256 in duty cycle x256 per km/h x10
+#define CRUISE_PID_KP_X256_48V_MOTOR                              780 // 3.05 duty cycle steps per 0.1 km/h
+#define CRUISE_PID_KI_X256_48V_MOTOR                              65
+#define CRUISE_PID_KP_X256_36V_MOTOR                              910
+#define CRUISE_PID_KI_X256_36V_MOTOR                              46
+#define CRUISE_PID_KD_X256                                        512
+#define CRUISE_PID_DERIVATIVE_FILTER_SHIFT                        2   // 4 * 25ms = 100ms
+#define CRUISE_PID_DERIVATIVE_SPEED_DELTA_MAX                     100 // 10 km/h in 25ms is a speed glitch
+#define CRUISE_FEEDFORWARD_FACTOR                                 91  // 3/4 of 121
+
+/*---------------------------------------------------------
+ NOTE: regarding the cruise feedforward
+
+ Road load is seen as phase current, the duty cycle x256
+ needed for the resistive voltage drop is:
+
+ D = I * 0.16 * R (mOhm) / 1000 / (V * 0.087) * 256
+   = I * R * 121 / V
+
+ with I and V in ADC steps. Only 3/4 of the drop is
+ compensated so the feedforward never drives the current
+ up by itself, the integral does the rest.
+ ---------------------------------------------------------*/
+
 #endif // _MAIN_H_
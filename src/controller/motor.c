@@ -76,28 +76,46 @@ volatile uint16_t ui16_adc_voltage;
 volatile uint16_t ui16_adc_torque;
 volatile uint16_t ui16_adc_throttle;
 
+// ADC filter stage: boxcar accumulation decimated to a first order IIR filter
+volatile uint16_t ui16_adc_throttle_filtered = 0;
+volatile uint8_t ui8_adc_voltage_filter_shift = ADC_FILTER_IIR_SHIFT_DEFAULT;
+volatile uint8_t ui8_adc_throttle_filter_shift = ADC_FILTER_IIR_SHIFT_DEFAULT;
+static uint16_t ui16_adc_voltage_boxcar = 0;
+static uint16_t ui16_adc_throttle_boxcar = 0;
+static uint16_t ui16_adc_voltage_filtered_x16 = 0;
+static uint16_t ui16_adc_throttle_filtered_x16 = 0;
+static uint8_t ui8_adc_filter_counter = 0;
+
+// torque sensor samples accumulation, free running: users take the difference from their last reading
+volatile uint32_t ui32_adc_torque_accumulated = 0;
+volatile uint16_t ui16_adc_torque_accumulated_count = 0;
+// accumulation latched at every crank sector (1/20 revolution) start
+volatile uint32_t ui32_adc_torque_crank_sector_accumulated = 0;
+volatile uint16_t ui16_adc_torque_crank_sector_count = 0;
+volatile uint8_t ui8_crank_sector_counter = 0;
+static uint8_t ui8_torque_sensor_excitation_synchronized = 0;
+
 // brakes
 volatile uint8_t ui8_brake_state = 0;
+volatile uint8_t ui8_brake_pwm_disabled = 0;
+volatile uint16_t ui16_adc_coaster_brake_threshold = 0; // pedal torque ADC value for coaster brake, 0 = disabled
+static uint8_t ui8_brake_release_counter = 0;
+volatile uint8_t ui8_pas_backward = 0;
 
 // cadence sensor
-#define NO_PAS_REF 5
-volatile uint16_t ui16_cadence_sensor_ticks = 0;
+volatile uint16_t ui16_cadence_sensor_edge_interval[CADENCE_SENSOR_EDGES_BUFFER_SIZE]; // TIM3 ticks between forward transitions
+volatile uint8_t ui8_cadence_sensor_edge_index = 0;
+volatile uint8_t ui8_cadence_sensor_edges_valid = 0;
+volatile uint16_t ui16_cadence_sensor_edge_time = 0;
 volatile uint32_t ui32_crank_revolutions_x20 = 0;
-static uint16_t ui16_cadence_sensor_ticks_counter_min = CADENCE_SENSOR_CALC_COUNTER_MIN;
 static uint8_t ui8_pas_state_old = 4;
-static uint16_t ui16_cadence_calc_counter, ui16_cadence_stop_counter;
-static uint8_t ui8_cadence_calc_ref_state = NO_PAS_REF;
+static uint16_t ui16_cadence_sensor_edge_time_new;
 const static uint8_t ui8_pas_old_valid_state[4] = { 0x01, 0x03, 0x00, 0x02 };
 
-// wheel speed sensor
-volatile uint16_t ui16_wheel_speed_sensor_ticks = 0;
-volatile uint32_t ui32_wheel_speed_sensor_ticks_total = 0;
-
 // field weakening
 volatile uint8_t ui8_field_weakening_enabled = 0;
 volatile uint8_t ui8_field_weakening_state_enabled = 0;
 
-void read_battery_voltage(void);
 void calc_foc_angle(void);
 
 
@@ -108,7 +126,6 @@ void motor_controller(void) {
     else
         // Reduce operands to 16 bit (Avoid slow _divulong() library function)
         ui16_motor_speed_erps = (uint16_t)(HALL_COUNTER_FREQ >> 2) / (uint16_t)(ui16_hall_counter_total >> 2);
-    read_battery_voltage();
     calc_foc_angle();
 }
 
@@ -133,7 +150,6 @@ void motor_controller(void) {
 // Down interrupt is used for:
 //  - calculate rotor position (based on HAL sensors state and interpolation based on counters)
 //  - Apply phase voltage and duty cycle to TIM1 outputs according to rotor position
-//  - Read Wheel speed sensor and wheel speed computation
 
 #ifdef __CDT_PARSER__
 #define __interrupt(x)  // Disable Eclipse syntax check on interrupt keyword
@@ -626,14 +642,64 @@ void TIM1_CAP_COM_IRQHandler(void) __interrupt(TIM1_CAP_COM_IRQHANDLER)
         __endasm;
         #endif
 
+        // accumulate all the torque sensor samples, they are decimated in ebike_app
+        ui32_adc_torque_accumulated += ui16_adc_torque;
+        ui16_adc_torque_accumulated_count++;
+
+        // ADC filter stage: boxcar of ADC_FILTER_BOXCAR_SAMPLES samples then first order IIR filter,
+        // the channels are decimated in different PWM cycles to keep the interrupt time bounded
+        ui16_adc_voltage_boxcar += ui16_adc_voltage;
+        ui16_adc_throttle_boxcar += ui16_adc_throttle;
+        ui8_adc_filter_counter = (ui8_adc_filter_counter + 1) & (ADC_FILTER_BOXCAR_SAMPLES - 1);
+
+        if (ui8_adc_filter_counter == 0) {
+            if (ui16_adc_voltage_filtered_x16)
+                ui16_adc_voltage_filtered_x16 += (int16_t)(ui16_adc_voltage_boxcar - ui16_adc_voltage_filtered_x16) >> ui8_adc_voltage_filter_shift;
+            else
+                ui16_adc_voltage_filtered_x16 = ui16_adc_voltage_boxcar;
+            ui16_adc_battery_voltage_filtered = ui16_adc_voltage_filtered_x16 >> 4;
+            ui16_adc_voltage_boxcar = 0;
+        } else if (ui8_adc_filter_counter == 1) {
+            if (ui16_adc_throttle_filtered_x16)
+                ui16_adc_throttle_filtered_x16 += (int16_t)(ui16_adc_throttle_boxcar - ui16_adc_throttle_filtered_x16) >> ui8_adc_throttle_filter_shift;
+            else
+                ui16_adc_throttle_filtered_x16 = ui16_adc_throttle_boxcar;
+            ui16_adc_throttle_filtered = ui16_adc_throttle_filtered_x16 >> 4;
+            ui16_adc_throttle_boxcar = 0;
+        }
+
+        // lock the torque sensor excitation phase to the ADC sampling, only needed once because
+        // both timers run from the same clock and the PWM period is 3 excitation periods
+        if (!ui8_torque_sensor_excitation_synchronized) {
+            TIM2->CNTRH = 0;
+            TIM2->CNTRL = TORQUE_SENSOR_EXCITATION_PHASE;
+            ui8_torque_sensor_excitation_synchronized = 1;
+        }
+
 
         /****************************************************************************/
         // brake state (used also in ebike_app loop)
-        // - check if coaster brake is engaged
+        // - check if coaster brake is engaged: pedal torque under the offset after a backward pedal rotation
         // - check if brakes are engaged
-
-            // set brake state
-            ui8_brake_state = ((BRAKE__PORT->IDR & BRAKE__PIN) ^ BRAKE__PIN);
+        // The brake is set at the first active sample and released only after it is inactive for the debounce time
+
+        if ((!(BRAKE__PORT->IDR & BRAKE__PIN))
+                || ((ui8_pas_backward) && (ui16_adc_torque < ui16_adc_coaster_brake_threshold))) {
+            if (!ui8_brake_state) {
+                // cut duty cycle and field weakening and disable the PWM outputs now, ebike_app enables them again
+                ui8_g_duty_cycle = 0;
+                ui8_fw_hall_counter_offset = 0;
+                TIM1->CCER1 = 0;
+                TIM1->CCER2 = 0;
+                ui8_brake_pwm_disabled = 1;
+                ui8_brake_state = 1;
+            }
+            ui8_brake_release_counter = 0;
+        } else if (ui8_brake_state) {
+            if (++ui8_brake_release_counter >= BRAKE_RELEASE_DEBOUNCE_CYCLES) {
+                ui8_brake_state = 0;
+            }
+        }
 
 
         /****************************************************************************/
@@ -654,7 +720,7 @@ void TIM1_CAP_COM_IRQHandler(void) __interrupt(TIM1_CAP_COM_IRQHANDLER)
                 || (ui8_adc_battery_current_filtered > ui8_controller_adc_battery_current_target)
                 || (ui8_adc_motor_phase_current > ADC_10_BIT_MOTOR_PHASE_CURRENT_MAX)
                 || (ui16_hall_counter_total < (HALL_COUNTER_FREQ / MOTOR_OVER_SPEED_ERPS))
-                || (ui16_adc_voltage < ui16_adc_voltage_cut_off)
+                || (ui16_adc_battery_voltage_filtered < ui16_adc_voltage_cut_off)
                 || (ui8_brake_state)) {
             // reset duty cycle ramp up counter (filter)
             ui8_counter_duty_cycle_ramp_up = 0;
@@ -704,66 +770,16 @@ void TIM1_CAP_COM_IRQHandler(void) __interrupt(TIM1_CAP_COM_IRQHANDLER)
         }
 
 
-
-        /****************************************************************************/
-        // Wheel speed sensor detection
-
-        static uint16_t ui16_wheel_speed_sensor_ticks_counter;
-        static uint8_t ui8_wheel_speed_sensor_ticks_counter_started;
-        static uint8_t ui8_wheel_speed_sensor_pin_state_old;
-
-        // check wheel speed sensor pin state
-        ui8_temp = WHEEL_SPEED_SENSOR__PORT->IDR & WHEEL_SPEED_SENSOR__PIN;
-
-        // check if wheel speed sensor pin state has changed
-        if (ui8_temp != ui8_wheel_speed_sensor_pin_state_old) {
-            // update old wheel speed sensor pin state
-            ui8_wheel_speed_sensor_pin_state_old = ui8_temp;
-
-            // only consider the 0 -> 1 transition
-            if (ui8_temp) {
-                // check if first transition
-                if (!ui8_wheel_speed_sensor_ticks_counter_started) {
-                    // start wheel speed sensor ticks counter as this is the first transition
-                    ui8_wheel_speed_sensor_ticks_counter_started = 1;
-                } else {
-                    // check if wheel speed sensor ticks counter is out of bounds
-                    if (ui16_wheel_speed_sensor_ticks_counter < WHEEL_SPEED_SENSOR_TICKS_COUNTER_MAX) {
-                        ui16_wheel_speed_sensor_ticks = 0;
-                        ui16_wheel_speed_sensor_ticks_counter = 0;
-                        ui8_wheel_speed_sensor_ticks_counter_started = 0;
-                    } else {
-                        ui16_wheel_speed_sensor_ticks = ui16_wheel_speed_sensor_ticks_counter;
-                        ui16_wheel_speed_sensor_ticks_counter = 0;
-                        ++ui32_wheel_speed_sensor_ticks_total;
-                    }
-                }
-            }
-        }
-
-        // increment and also limit the ticks counter
-        if (ui8_wheel_speed_sensor_ticks_counter_started)
-            if (ui16_wheel_speed_sensor_ticks_counter < WHEEL_SPEED_SENSOR_TICKS_COUNTER_MIN) {
-                ++ui16_wheel_speed_sensor_ticks_counter;
-            } else {
-                // reset variables
-                ui16_wheel_speed_sensor_ticks = 0;
-                ui16_wheel_speed_sensor_ticks_counter = 0;
-                ui8_wheel_speed_sensor_ticks_counter_started = 0;
-            }
-
-
         /****************************************************************************/
         /*
-         * - New pedal start/stop detection Algorithm (by MSpider65) -
+         * - Pedal cadence sensor -
          *
-         * Pedal start/stop detection uses both transitions of both PAS sensors
          * ui8_temp stores the PAS1 and PAS2 state: bit0=PAS1,  bit1=PAS2
          * Pedal forward ui8_temp sequence is: 0x01 -> 0x00 -> 0x02 -> 0x03 -> 0x01
-         * After a stop, the first forward transition is taken as reference transition
-         * Following forward transition sets the cadence to 7RPM for immediate startup
-         * Then, starting form the second reference transition, the cadence is calculated based on counter value
-         * All transitions resets the stop detection counter (much faster stop detection):
+         * All transitions are timestamped with TIM3 and the time from the previous
+         * transition is saved in a circular buffer. Cadence and pedal stop are
+         * calculated in ebike_app from the buffer.
+         * A backward transition invalidates the buffer.
          */
         ui8_temp = 0;
         if (PAS1__PORT->IDR & PAS1__PIN)
@@ -772,57 +788,46 @@ void TIM1_CAP_COM_IRQHandler(void) __interrupt(TIM1_CAP_COM_IRQHANDLER)
             ui8_temp |= (unsigned char)0x02;
 
         if (ui8_temp != ui8_pas_state_old) {
+            // transition timestamp (TIM3, 4us)
+            // ui16_cadence_sensor_edge_time_new = TIM3 counter, Hall GPIO interrupt must not read TIM3 in between
+            #ifndef __CDT_PARSER__ // avoid Eclipse syntax check
+            __asm
+            push cc             // save current Interrupt Mask (I1,I0 bits of CC register)
+            sim                 // disable interrupts  (set I0,I1 bits of CC register to 1,1)
+            mov _ui16_cadence_sensor_edge_time_new+0, 0x5328 // TIM3->CNTRH
+            mov _ui16_cadence_sensor_edge_time_new+1, 0x5329 // TIM3->CNTRL
+            pop cc              // enable interrupts (restores previous value of Interrupt mask)
+            __endasm;
+            #endif
+
             if (ui8_pas_state_old != ui8_pas_old_valid_state[ui8_temp]) {
                 // wrong state sequence: backward rotation
-                ui16_cadence_sensor_ticks = 0;
-                ui8_cadence_calc_ref_state = NO_PAS_REF;
-                goto skip_cadence;
-            }
+                ui8_cadence_sensor_edges_valid = 0;
+                ui8_pas_backward = 1;
+            } else {
+                ui8_pas_backward = 0;
 
-			// motor fast stop
-			if(ui16_cadence_sensor_ticks) {
-				ui16_cadence_sensor_ticks_counter_min = ui16_cadence_sensor_ticks - (CADENCE_SENSOR_STANDARD_MODE_SCHMITT_TRIGGER_THRESHOLD >> 1);
-			}
-			else {
-				ui16_cadence_sensor_ticks_counter_min = ui16_cadence_ticks_count_min_speed_adj;
-			}
-	
+                // Reference state for crank revolution counter increment
+                if (ui8_temp == 0) {
+                    ui32_crank_revolutions_x20++;
 
-            // Reference state for crank revolution counter increment
-            if (ui8_temp == 0)
-                ui32_crank_revolutions_x20++;
-
-            if (ui8_temp == ui8_cadence_calc_ref_state) {
-                // ui16_cadence_calc_counter is valid for cadence calculation
-                ui16_cadence_sensor_ticks = ui16_cadence_calc_counter;
-                ui16_cadence_calc_counter = 0;
-                // software based Schmitt trigger to stop motor jitter when at resolution limits
-                ui16_cadence_sensor_ticks_counter_min += CADENCE_SENSOR_STANDARD_MODE_SCHMITT_TRIGGER_THRESHOLD;
-            } else if (ui8_cadence_calc_ref_state == NO_PAS_REF) {
-                // this is the new reference state for cadence calculation
-                ui8_cadence_calc_ref_state = ui8_temp;
-                ui16_cadence_calc_counter = 0;
-            } else if (ui16_cadence_sensor_ticks == 0) {
-                // Waiting the second reference transition: set the cadence to 7 RPM for immediate start
-                ui16_cadence_sensor_ticks = CADENCE_TICKS_STARTUP;
+                    // latch the torque samples accumulation at the start of each crank sector
+                    ui32_adc_torque_crank_sector_accumulated = ui32_adc_torque_accumulated;
+                    ui16_adc_torque_crank_sector_count = ui16_adc_torque_accumulated_count;
+                    ui8_crank_sector_counter++;
+                }
+
+                // save time from previous transition
+                ui8_cadence_sensor_edge_index = (ui8_cadence_sensor_edge_index + 1) & (CADENCE_SENSOR_EDGES_BUFFER_SIZE - 1);
+                ui16_cadence_sensor_edge_interval[ui8_cadence_sensor_edge_index] = ui16_cadence_sensor_edge_time_new - ui16_cadence_sensor_edge_time;
+                if (ui8_cadence_sensor_edges_valid <= CADENCE_SENSOR_EDGES_BUFFER_SIZE)
+                    ++ui8_cadence_sensor_edges_valid;
             }
 
-            skip_cadence:
-            // reset the counter used to detect pedal stop
-            ui16_cadence_stop_counter = 0;
+            ui16_cadence_sensor_edge_time = ui16_cadence_sensor_edge_time_new;
             // save current PAS state
             ui8_pas_state_old = ui8_temp;
         }
-
-        if (++ui16_cadence_stop_counter > ui16_cadence_sensor_ticks_counter_min) {
-            // pedals stop detected
-            ui16_cadence_sensor_ticks = 0;
-            ui16_cadence_stop_counter = 0;
-            ui8_cadence_calc_ref_state = NO_PAS_REF;
-        } else if (ui8_cadence_calc_ref_state != NO_PAS_REF) {
-            // increment cadence tick counter
-            ++ui16_cadence_calc_counter;
-        }
     }
 
     /****************************************************************************/
@@ -858,26 +863,6 @@ void hall_sensor_init(void) {
     EXTI_SetTLISensitivity(EXTI_TLISENSITIVITY_FALL_ONLY);
 }
 
-void read_battery_voltage(void) {
-#define READ_BATTERY_VOLTAGE_FILTER_COEFFICIENT   2
-
-    /*---------------------------------------------------------
-     NOTE: regarding filter coefficients
-
-     Possible values: 0, 1, 2, 3, 4, 5, 6
-     0 equals to no filtering and no delay, higher values
-     will increase filtering but will also add a bigger delay.
-     ---------------------------------------------------------*/
-
-    static uint16_t ui16_adc_battery_voltage_accumulated;
-
-    // low pass filter the voltage readed value, to avoid possible fast spikes/noise
-    ui16_adc_battery_voltage_accumulated -= ui16_adc_battery_voltage_accumulated
-            >> READ_BATTERY_VOLTAGE_FILTER_COEFFICIENT;
-    ui16_adc_battery_voltage_accumulated += ui16_adc_voltage;
-    ui16_adc_battery_voltage_filtered = ui16_adc_battery_voltage_accumulated >> READ_BATTERY_VOLTAGE_FILTER_COEFFICIENT;
-}
-
 void calc_foc_angle(void) {
     
 	#define READ_FOC_FILTER_COEFFICIENT   4
@@ -10,6 +10,7 @@
 #define _MOTOR_H_
 
 #include <stdint.h>
+#include "main.h"
 
 // motor states
 #define BLOCK_COMMUTATION 			            0
@@ -34,17 +35,27 @@ extern volatile uint16_t ui16_motor_speed_erps;
 
 // Sensors
 extern volatile uint8_t ui8_brake_state;
+extern volatile uint8_t ui8_brake_pwm_disabled;
+extern volatile uint16_t ui16_adc_coaster_brake_threshold;
+extern volatile uint8_t ui8_pas_backward;
 extern volatile uint16_t ui16_adc_torque;
+extern volatile uint32_t ui32_adc_torque_accumulated;
+extern volatile uint16_t ui16_adc_torque_accumulated_count;
+extern volatile uint32_t ui32_adc_torque_crank_sector_accumulated;
+extern volatile uint16_t ui16_adc_torque_crank_sector_count;
+extern volatile uint8_t ui8_crank_sector_counter;
 extern volatile uint16_t ui16_adc_throttle;
+extern volatile uint16_t ui16_adc_throttle_filtered;
+extern volatile uint8_t ui8_adc_voltage_filter_shift;
+extern volatile uint8_t ui8_adc_throttle_filter_shift;
 
 // cadence sensor
-extern volatile uint16_t ui16_cadence_sensor_ticks;
+extern volatile uint16_t ui16_cadence_sensor_edge_interval[CADENCE_SENSOR_EDGES_BUFFER_SIZE];
+extern volatile uint8_t ui8_cadence_sensor_edge_index;
+extern volatile uint8_t ui8_cadence_sensor_edges_valid;
+extern volatile uint16_t ui16_cadence_sensor_edge_time;
 extern volatile uint32_t ui32_crank_revolutions_x20;
 
-// wheel speed sensor
-extern volatile uint16_t ui16_wheel_speed_sensor_ticks;
-extern volatile uint32_t ui32_wheel_speed_sensor_ticks_total;
-
 void hall_sensor_init(void); // must be called before using the motor
 
 // field weakening
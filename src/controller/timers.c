@@ -8,8 +8,10 @@
 
 #include "stm8s.h"
 #include "interrupts.h"
+#include "main.h"
 
 volatile uint8_t ui8_tim4_counter = 0;
+volatile uint16_t ui16_tim3_overflow_counter = 0;
 
 #ifdef __CDT_PARSER__
 #define __interrupt(x)
@@ -26,18 +28,18 @@ void timers_init() {
 }
 
 // Timer2 is used to create the pulse signal for excitation of the torque sensor circuit
-// Pulse signal: period of 20us, Ton = 2us, Toff = 18us
+// Pulse signal: period of 18.5us (1/3 of PWM period), Ton = 2us, Toff = 16.5us
 void timer2_init(void) {
     uint16_t ui16_i;
 
-    // Timer2 clock = 16MHz; target: 20us period --> 50khz
-    // counter period = (1 / (16000000 / prescaler)) * (159 + 1) = 20us
-    TIM2_TimeBaseInit(TIM2_PRESCALER_2, 159);
+    // Timer2 clock = 16MHz; target: 18.5us period --> 54khz
+    // counter period = (1 / (16000000 / prescaler)) * (147 + 1) = 18.5us
+    TIM2_TimeBaseInit(TIM2_PRESCALER_2, TORQUE_SENSOR_EXCITATION_COUNTER_MAX);
 
     // pulse of 2us
     TIM2_OC2Init(TIM2_OCMODE_PWM1,
             TIM2_OUTPUTSTATE_ENABLE,
-            16,
+            TORQUE_SENSOR_EXCITATION_PULSE,
             TIM2_OCPOLARITY_HIGH);
     TIM2_OC2PreloadConfig(ENABLE);
 
@@ -60,6 +62,8 @@ void timer3_init(void) {
     // TIM3 Peripheral Configuration
     TIM3_DeInit();
     TIM3_TimeBaseInit(TIM3_PRESCALER_64, 0xffff); // 16MHz/64=250KHz
+    ITC_SetSoftwarePriority(TIM3_OVF_IRQHANDLER, ITC_PRIORITYLEVEL_1); // same priority as wheel speed sensor interrupt
+    TIM3_ITConfig(TIM3_IT_UPDATE, ENABLE); // overflows extend the counter for the wheel speed sensor (see below TIM3_IRQHandler function)
     TIM3_Cmd(ENABLE); // TIM3 counter enable
 
     // IMPORTANT: this software delay is needed so timer3 work after this
@@ -84,6 +88,12 @@ void timer4_init(void) {
     }
 }
 
+// TIM3 Overflow Interrupt handler (every 262ms)
+void TIM3_IRQHandler(void) __interrupt(TIM3_OVF_IRQHANDLER) {
+    ui16_tim3_overflow_counter++;
+    TIM3->SR1 = 0; // Reset interrupt flag
+}
+
 // TIM4 Overflow Interrupt handler
 void TIM4_IRQHandler(void) __interrupt(TIM4_OVF_IRQHANDLER) {
     ui8_tim4_counter++;
@@ -12,5 +12,6 @@
 void timers_init(void);
 
 extern volatile uint8_t ui8_tim4_counter;
+extern volatile uint16_t ui16_tim3_overflow_counter;
 
 #endif /* _TIMERS_H_ */
@@ -11,9 +11,75 @@
 #include "pins.h"
 #include "main.h"
 #include "interrupts.h"
-#include "motor.h"
+#include "timers.h"
+#include "wheel_speed_sensor.h"
+
+// wheel speed sensor transitions, time in TIM3 ticks (4us) extended to 32 bits with the TIM3 overflows
+volatile uint32_t ui32_wheel_speed_sensor_edge_time = 0;
+volatile uint32_t ui32_wheel_speed_sensor_edge_interval = 0;
+volatile uint8_t ui8_wheel_speed_sensor_edges_valid = 0;
+volatile uint8_t ui8_wheel_speed_sensor_magnets = 1;
+volatile uint16_t ui16_wheel_speed_sensor_interval_min = WHEEL_SPEED_SENSOR_INTERVAL_MIN;
+volatile uint32_t ui32_wheel_speed_sensor_ticks_total = 0; // wheel revolutions
+static uint8_t ui8_wheel_speed_sensor_magnet_counter = 0;
+static uint16_t ui16_wheel_speed_sensor_time_now;
+
+#ifdef __CDT_PARSER__
+#define __interrupt(x)
+#endif
 
 void wheel_speed_sensor_init(void) {
-    //wheel speed sensor pin as input pull-up, no external interrupt
-    GPIO_Init(WHEEL_SPEED_SENSOR__PORT, WHEEL_SPEED_SENSOR__PIN, GPIO_MODE_IN_PU_NO_IT);
+    //wheel speed sensor pin as input pull-up, external interrupt on rising edge
+    GPIO_Init(WHEEL_SPEED_SENSOR__PORT, WHEEL_SPEED_SENSOR__PIN, GPIO_MODE_IN_PU_IT);
+
+    // same priority as TIM3 overflow interrupt, so TIM3 overflows can be checked with the update flag
+    ITC_SetSoftwarePriority(EXTI_WHEEL_SPEED_SENSOR_IRQ, ITC_PRIORITYLEVEL_1);
+
+    // sensitivity can only be set while interrupts are disabled
+    EXTI_SetExtIntSensitivity(EXTI_PORT_GPIOA, EXTI_SENSITIVITY_RISE_ONLY);
+}
+
+// Wheel speed sensor 0 -> 1 transition
+void WHEEL_SPEED_SENSOR_PORT_IRQHandler(void) __interrupt(EXTI_WHEEL_SPEED_SENSOR_IRQ) {
+    uint32_t ui32_time;
+    uint32_t ui32_interval;
+
+    // ui16_wheel_speed_sensor_time_now = TIM3 counter, Hall GPIO interrupt must not read TIM3 in between
+    #ifndef __CDT_PARSER__ // avoid Eclipse syntax check
+    __asm
+    push cc             // save current Interrupt Mask (I1,I0 bits of CC register)
+    sim                 // disable interrupts  (set I0,I1 bits of CC register to 1,1)
+    mov _ui16_wheel_speed_sensor_time_now+0, 0x5328 // TIM3->CNTRH
+    mov _ui16_wheel_speed_sensor_time_now+1, 0x5329 // TIM3->CNTRL
+    pop cc              // enable interrupts (restores previous value of Interrupt mask)
+    __endasm;
+    #endif
+
+    // extend to 32 bits, TIM3 overflow interrupt may be pending
+    ui32_time = ((uint32_t) ui16_tim3_overflow_counter << 16) | ui16_wheel_speed_sensor_time_now;
+    if ((TIM3->SR1 & TIM3_SR1_UIF) && !(ui16_wheel_speed_sensor_time_now & 0x8000)) {
+        ui32_time += 0x10000;
+    }
+
+    if (ui8_wheel_speed_sensor_edges_valid) {
+        ui32_interval = ui32_time - ui32_wheel_speed_sensor_edge_time;
+
+        // ignore the transition if too close to the previous one (noise)
+        if (ui32_interval < ui16_wheel_speed_sensor_interval_min) {
+            return;
+        }
+
+        ui32_wheel_speed_sensor_edge_interval = ui32_interval;
+        ui8_wheel_speed_sensor_edges_valid = 2;
+    } else {
+        // first transition after a stop is only the reference
+        ui8_wheel_speed_sensor_edges_valid = 1;
+    }
+    ui32_wheel_speed_sensor_edge_time = ui32_time;
+
+    // count wheel revolutions
+    if (++ui8_wheel_speed_sensor_magnet_counter >= ui8_wheel_speed_sensor_magnets) {
+        ui8_wheel_speed_sensor_magnet_counter = 0;
+        ++ui32_wheel_speed_sensor_ticks_total;
+    }
 }
@@ -9,6 +9,15 @@
 #ifndef _WHELL_SPEED_SENSOR_H_
 #define _WHELL_SPEED_SENSOR_H_
 
+#include <stdint.h>
+
+extern volatile uint32_t ui32_wheel_speed_sensor_edge_time;
+extern volatile uint32_t ui32_wheel_speed_sensor_edge_interval;
+extern volatile uint8_t ui8_wheel_speed_sensor_edges_valid;
+extern volatile uint8_t ui8_wheel_speed_sensor_magnets;
+extern volatile uint16_t ui16_wheel_speed_sensor_interval_min;
+extern volatile uint32_t ui32_wheel_speed_sensor_ticks_total;
+
 void wheel_speed_sensor_init(void);
 
 #endif /* _WHELL_SPEED_SENSOR_H_ */